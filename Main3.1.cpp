@@ -7,30 +7,243 @@
 #include <sstream>
 #include <cstdlib>
 #include <ctime>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <iterator>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// SSE2 is the x64 baseline; the AVX kernel is compiled in as well and only
+// selected when cpuid reports it at run time
+#if defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define BEZIER_SIMD
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BEZIER_AVX_TARGET
+#else
+#define BEZIER_AVX_TARGET __attribute__((target("avx")))
+#endif
+#endif
 
 struct Point3D {
     float x, y, z;
     Point3D(float x = 0, float y = 0, float z = 0) : x(x), y(y), z(z) {}
 };
 
+// Fixed set of worker threads for data-parallel loops. parallelFor splits
+// [0, count) into chunks that the workers and the calling thread pull from
+// a shared counter, and returns once every chunk is done. Workers are
+// started on first use.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int, int)>* job;
+    int jobCount;
+    int chunkSize;
+    std::atomic<int> nextChunk;
+    int pendingWorkers;
+    unsigned generation;
+    bool stopping;
+    int threadCount;
+
+    void runChunks() {
+        for (;;) {
+            int begin = nextChunk.fetch_add(chunkSize);
+            if (begin >= jobCount) break;
+            (*job)(begin, std::min(begin + chunkSize, jobCount));
+        }
+    }
+
+    void workerLoop() {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            runChunks();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pendingWorkers == 0) finished.notify_one();
+            }
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+        workers.clear();
+        stopping = false;
+    }
+
+public:
+    explicit ThreadPool(int threads = 0) : job(NULL), jobCount(0), chunkSize(1), nextChunk(0),
+        pendingWorkers(0), generation(0), stopping(false), threadCount(1) {
+        setThreadCount(threads);
+    }
+
+    ~ThreadPool() {
+        stop();
+    }
+
+    int getThreadCount() const { return threadCount; }
+
+    // Threads including the caller; 0 means one per hardware thread
+    void setThreadCount(int threads) {
+        stop();
+        if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+        threadCount = std::max(1, threads);
+    }
+
+    // Calls body(begin, end) over [0, count) in chunks of at least grain
+    void parallelFor(int count, const std::function<void(int, int)>& body, int grain = 1) {
+        if (count <= 0) return;
+
+        // A few chunks per thread so uneven patches still balance
+        int chunk = std::max(grain, (count + threadCount * 4 - 1) / (threadCount * 4));
+        if (threadCount == 1 || count <= chunk) {
+            body(0, count);
+            return;
+        }
+
+        if (workers.empty()) {
+            for (int i = 1; i < threadCount; i++) workers.emplace_back(&ThreadPool::workerLoop, this);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &body;
+            jobCount = count;
+            chunkSize = chunk;
+            nextChunk = 0;
+            pendingWorkers = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        runChunks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return pendingWorkers == 0; });
+        job = NULL;
+    }
+};
+
 class Texture2D {
 private:
     GLuint textureID;
     int width, height;
 
-public:
-    Texture2D() : textureID(0), width(0), height(0) {}
+    // sin(x) for the generator: x = k * pi + r with r in [-pi/2, pi/2],
+    // then a degree 9 Taylor polynomial in r (error below 4e-6) and the
+    // sign of (-1)^k. The SIMD kernel does the same operations lane-wise.
+    static float fastSin(float x) {
+        int k = (int)lrintf(x * INV_PI);
+        float r = x - k * PI_HIGH - k * PI_LOW;
+        float r2 = r * r;
+        float s = r + r * r2 * (SIN_C3 + r2 * (SIN_C5 + r2 * (SIN_C7 + r2 * SIN_C9)));
+        return (k & 1) ? -s : s;
+    }
 
-    bool createProcedural(int w, int h) {
-        width = w;
-        height = h;
+    static const float INV_PI;
+    static const float PI_HIGH;
+    static const float PI_LOW;
+    static const float SIN_C3;
+    static const float SIN_C5;
+    static const float SIN_C7;
+    static const float SIN_C9;
+
+    static unsigned int packTexel(float r, float g, float b) {
+        return (unsigned int)(unsigned char)(r * 255) | (unsigned int)(unsigned char)(g * 255) << 8 |
+            (unsigned int)(unsigned char)(b * 255) << 16 | 0xFF000000u;
+    }
+
+#ifdef BEZIER_SIMD
+    static __m128 fastSin4(__m128 x) {
+        __m128i k = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(INV_PI)));
+        __m128 kf = _mm_cvtepi32_ps(k);
+        __m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(kf, _mm_set1_ps(PI_HIGH))), _mm_mul_ps(kf, _mm_set1_ps(PI_LOW)));
+        __m128 r2 = _mm_mul_ps(r, r);
+        __m128 poly = _mm_add_ps(_mm_set1_ps(SIN_C7), _mm_mul_ps(r2, _mm_set1_ps(SIN_C9)));
+        poly = _mm_add_ps(_mm_set1_ps(SIN_C5), _mm_mul_ps(r2, poly));
+        poly = _mm_add_ps(_mm_set1_ps(SIN_C3), _mm_mul_ps(r2, poly));
+        __m128 s = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), poly));
+        // Odd k flips the sign bit
+        return _mm_xor_ps(s, _mm_castsi128_ps(_mm_slli_epi32(k, 31)));
+    }
+#endif
+
+    // Rows [y0, y1) of the w x h image as RGBA texels. Same pattern and
+    // operation order as fillReference() apart from the sine.
+    static void fillRows(int w, int h, int y0, int y1, unsigned int* texels) {
+        float halfW = w / 2.0f, halfH = h / 2.0f;
+        for (int y = y0; y < y1; y++) {
+            unsigned int* row = texels + (size_t)y * w;
+            float fy = (float)y / h * 8.0f;
+            float dy = (y - halfH) / halfH;
+            int x = 0;
+#ifdef BEZIER_SIMD
+            __m128 fyv = _mm_set1_ps(fy);
+            __m128 dy2 = _mm_set1_ps(dy * dy);
+            __m128 wv = _mm_set1_ps((float)w);
+            __m128 halfWv = _mm_set1_ps(halfW);
+            __m128 half = _mm_set1_ps(0.5f);
+            __m128 one = _mm_set1_ps(1.0f);
+            __m128 scale = _mm_set1_ps(255.0f);
+            __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+            for (; x + 4 <= w; x += 4) {
+                __m128 xf = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x), lanes));
+                __m128 fx = _mm_mul_ps(_mm_div_ps(xf, wv), _mm_set1_ps(8.0f));
+
+                __m128 r = _mm_add_ps(half, _mm_mul_ps(half, fastSin4(_mm_add_ps(_mm_mul_ps(fx, _mm_set1_ps(2.0f)), _mm_mul_ps(fyv, _mm_set1_ps(1.0f))))));
+                __m128 g = _mm_add_ps(half, _mm_mul_ps(half, fastSin4(_mm_add_ps(_mm_mul_ps(fx, _mm_set1_ps(1.5f)), _mm_mul_ps(fyv, _mm_set1_ps(2.0f))))));
+                __m128 b = _mm_add_ps(half, _mm_mul_ps(half, fastSin4(_mm_add_ps(_mm_mul_ps(fx, _mm_set1_ps(1.0f)), _mm_mul_ps(fyv, _mm_set1_ps(1.5f))))));
+
+                __m128 dx = _mm_div_ps(_mm_sub_ps(xf, halfWv), halfWv);
+                __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+                __m128 radial = _mm_mul_ps(_mm_sub_ps(one, _mm_min_ps(dist, one)), _mm_set1_ps(0.3f));
+
+                __m128 ambient = _mm_set1_ps(0.7f);
+                __m128i ri = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(r, ambient), radial), scale));
+                __m128i gi = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(g, ambient), radial), scale));
+                __m128i bi = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(b, ambient), radial), scale));
+                __m128i packed = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+                    _mm_or_si128(_mm_slli_epi32(bi, 16), _mm_set1_epi32((int)0xFF000000u)));
+                _mm_storeu_si128((__m128i*)(row + x), packed);
+            }
+#endif
+            for (; x < w; x++) {
+                float fx = (float)x / w * 8.0f;
+                float r = 0.5f + 0.5f * fastSin(fx * 2.0f + fy * 1.0f);
+                float g = 0.5f + 0.5f * fastSin(fx * 1.5f + fy * 2.0f);
+                float b = 0.5f + 0.5f * fastSin(fx * 1.0f + fy * 1.5f);
+
+                float dx = (x - halfW) / halfW;
+                float dist = sqrtf(dx * dx + dy * dy);
+                float radial = 1.0f - std::min(dist, 1.0f);
 
-        
-        std::vector<unsigned char> imageData(w * h * 3);
+                row[x] = packTexel(r * 0.7f + radial * 0.3f, g * 0.7f + radial * 0.3f, b * 0.7f + radial * 0.3f);
+            }
+        }
+    }
 
+    // The original per-texel loop; benchmark() compares against it
+    static void fillReference(int w, int h, unsigned char* imageData) {
         for (int y = 0; y < h; y++) {
             for (int x = 0; x < w; x++) {
-                int index = (y * w + x) * 3;
+                size_t index = ((size_t)y * w + x) * 3;
 
                 
                 float fx = (float)x / w * 8.0f;
@@ -56,45 +269,1399 @@ public:
                 imageData[index + 2] = (unsigned char)(b * 255);
             }
         }
-
-        return uploadToGPU(imageData.data());
     }
 
-    bool uploadToGPU(unsigned char* data) {
-        glGenTextures(1, &textureID);
-        glBindTexture(GL_TEXTURE_2D, textureID);
+    // RGBA texels, rows split over the pool
+    void generate(int w, int h, std::vector<unsigned int>& texels, ThreadPool& pool) {
+        texels.resize((size_t)w * h);
+        pool.parallelFor(h, [&](int begin, int end) {
+            fillRows(w, h, begin, end, texels.data());
+        }, 4);
+    }
+
+public:
+    Texture2D() : textureID(0), width(0), height(0) {}
+
+    // Generates on the caller's pool (the one the patch tessellates on),
+    // so one thread count setting covers both
+    bool createProcedural(int w, int h, ThreadPool& pool) {
+        width = w;
+        height = h;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<unsigned int> texels;
+        generate(w, h, texels, pool);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "Procedural texture generated in " << ms << " ms (" << pool.getThreadCount() << " threads)" << std::endl;
+
+        return uploadToGPU((unsigned char*)texels.data());
+    }
+
+    // Generation time of the reference loop and the threaded SIMD
+    // generator from 512x512 to 8192x8192, and the largest channel
+    // difference between them
+    void benchmark(ThreadPool& pool) {
+        std::cout << "Procedural texture benchmark (" << pool.getThreadCount() << " threads)" << std::endl;
+        for (int size = 512; size <= 8192; size *= 2) {
+            std::vector<unsigned char> reference((size_t)size * size * 3);
+            auto start = std::chrono::high_resolution_clock::now();
+            fillReference(size, size, reference.data());
+            double referenceMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+            std::vector<unsigned int> texels;
+            start = std::chrono::high_resolution_clock::now();
+            generate(size, size, texels, pool);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+            int maxDifference = 0;
+            for (size_t i = 0; i < texels.size(); i++) {
+                for (int c = 0; c < 3; c++) {
+                    int value = (texels[i] >> (8 * c)) & 0xFF;
+                    maxDifference = std::max(maxDifference, std::abs(value - reference[i * 3 + c]));
+                }
+            }
+            std::cout << "  " << size << "x" << size << ": reference " << referenceMs << " ms, generator " << ms
+                << " ms, max difference " << maxDifference << " LSB" << std::endl;
+        }
+    }
+
+    // Texels are RGBA (alpha unused), stored as GL_RGB
+    bool uploadToGPU(unsigned char* data) {
+        glGenTextures(1, &textureID);
+        glBindTexture(GL_TEXTURE_2D, textureID);
+
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        std::cout << "Texture created: " << width << "x" << height << std::endl;
+        return true;
+    }
+
+    void bind() {
+        glBindTexture(GL_TEXTURE_2D, textureID);
+    }
+
+    GLuint getID() const { return textureID; }
+};
+
+const float Texture2D::INV_PI = 0.318309886f;
+// pi split so k * PI_HIGH is exact for the small k used here
+const float Texture2D::PI_HIGH = 3.140625f;
+const float Texture2D::PI_LOW = 9.67653589793e-4f;
+const float Texture2D::SIN_C3 = -1.0f / 6.0f;
+const float Texture2D::SIN_C5 = 1.0f / 120.0f;
+const float Texture2D::SIN_C7 = -1.0f / 5040.0f;
+const float Texture2D::SIN_C9 = 1.0f / 362880.0f;
+
+// Position and both partial derivatives of a surface at one (u, v)
+struct SurfacePoint {
+    Point3D position;
+    Point3D du;
+    Point3D dv;
+};
+
+// Binomial coefficient C(n, k), evaluated by the compiler when the
+// arguments are constants
+constexpr int binomial(int n, int k) {
+    int result = 1;
+    for (int j = 1; j <= k; j++) {
+        result = result * (n - j + 1) / j;
+    }
+    return result;
+}
+
+template<int Degree>
+struct BinomialRow {
+    float values[Degree + 1];
+
+    constexpr BinomialRow() : values() {
+        for (int k = 0; k <= Degree; k++) {
+            values[k] = float(binomial(Degree, k));
+        }
+    }
+};
+
+// Bernstein basis of a fixed degree and its derivative. All loop bounds are
+// constants, so the compiler unrolls them; basis and derivative hold
+// ORDER values.
+template<int Degree>
+struct BezierBasis {
+    static_assert(Degree >= 1, "BezierBasis needs degree 1 or higher");
+    static const int ORDER = Degree + 1;
+
+    static void evaluate(float t, float* basis, float* derivative) {
+        constexpr BinomialRow<Degree> row;
+        constexpr BinomialRow<Degree - 1> lowerRow;
+
+        // Powers t^k and (1 - t)^k
+        float tPower[ORDER], sPower[ORDER];
+        tPower[0] = sPower[0] = 1.0f;
+        for (int k = 1; k < ORDER; k++) {
+            tPower[k] = tPower[k - 1] * t;
+            sPower[k] = sPower[k - 1] * (1.0f - t);
+        }
+
+        // d/dt B(k,n) = n * (B(k-1,n-1) - B(k,n-1))
+        float lower[Degree];
+        for (int k = 0; k < Degree; k++) {
+            lower[k] = lowerRow.values[k] * tPower[k] * sPower[Degree - 1 - k];
+        }
+        for (int k = 0; k < ORDER; k++) {
+            basis[k] = row.values[k] * tPower[k] * sPower[Degree - k];
+            derivative[k] = Degree * ((k > 0 ? lower[k - 1] : 0.0f) - (k < Degree ? lower[k] : 0.0f));
+        }
+    }
+};
+
+// B-spline basis functions of a fixed degree that are non-zero on knot span
+// span (knots[span] <= t < knots[span + 1]), and their first derivatives;
+// algorithms A2.2 / A2.3 of Piegl and Tiller's "The NURBS Book"
+template<int Degree>
+struct SplineBasis {
+    static const int ORDER = Degree + 1;
+
+    static void evaluate(const float* knots, int span, float t, float* basis, float* derivative) {
+        // ndu[j][r]: basis functions above the diagonal, knot differences below
+        float ndu[ORDER][ORDER];
+        float left[ORDER], right[ORDER];
+        ndu[0][0] = 1.0f;
+        for (int j = 1; j <= Degree; j++) {
+            left[j] = t - knots[span + 1 - j];
+            right[j] = knots[span + j] - t;
+            float saved = 0.0f;
+            for (int r = 0; r < j; r++) {
+                ndu[j][r] = right[r + 1] + left[j - r];
+                float temp = ndu[r][j - 1] / ndu[j][r];
+                ndu[r][j] = saved + right[r + 1] * temp;
+                saved = left[j - r] * temp;
+            }
+            ndu[j][j] = saved;
+        }
+
+        for (int r = 0; r <= Degree; r++) {
+            basis[r] = ndu[r][Degree];
+            float d = 0.0f;
+            if (r > 0) d += ndu[r - 1][Degree - 1] / ndu[Degree][r - 1];
+            if (r < Degree) d -= ndu[r][Degree - 1] / ndu[Degree][r];
+            derivative[r] = Degree * d;
+        }
+    }
+
+    // The span containing t for controlCount control points; t at the end
+    // of the knot vector belongs to the last span
+    static int findSpan(const float* knots, int controlCount, float t) {
+        int last = controlCount - 1;
+        if (t >= knots[last + 1]) return last;
+        if (t <= knots[Degree]) return Degree;
+        int low = Degree, high = last + 1;
+        int middle = (low + high) / 2;
+        while (t < knots[middle] || t >= knots[middle + 1]) {
+            if (t < knots[middle]) high = middle;
+            else low = middle;
+            middle = (low + high) / 2;
+        }
+        return middle;
+    }
+};
+
+// Uniform B-spline basis on one span, with the local parameter t in [0, 1]:
+// the knots are the integers, so they fold into constants
+template<int Degree>
+struct UniformBSplineBasis {
+    static const int ORDER = Degree + 1;
+
+    static void evaluate(float t, float* basis, float* derivative) {
+        float knots[2 * ORDER];
+        for (int k = 0; k < 2 * ORDER; k++) knots[k] = float(k);
+        SplineBasis<Degree>::evaluate(knots, Degree, t + Degree, basis, derivative);
+    }
+};
+
+// Tensor-product patch over an ORDER_U x ORDER_V control net (row-major,
+// i * ORDER_V + j with i along u) for any fixed-degree basis with a
+// static evaluate(t, basis, derivative): Bezier or uniform B-spline. The
+// net is collapsed along u first, then along v.
+template<class BasisU, class BasisV>
+struct TensorPatch {
+    static const int ORDER_U = BasisU::ORDER;
+    static const int ORDER_V = BasisV::ORDER;
+
+    static SurfacePoint evaluate(const Point3D* net, float u, float v) {
+        float bu[ORDER_U], du[ORDER_U], bv[ORDER_V], dv[ORDER_V];
+        BasisU::evaluate(u, bu, du);
+        BasisV::evaluate(v, bv, dv);
+
+        SurfacePoint result;
+        for (int j = 0; j < ORDER_V; j++) {
+            Point3D row(0, 0, 0), derivativeRow(0, 0, 0);
+            for (int i = 0; i < ORDER_U; i++) {
+                const Point3D& cp = net[i * ORDER_V + j];
+                row.x += cp.x * bu[i];
+                row.y += cp.y * bu[i];
+                row.z += cp.z * bu[i];
+                derivativeRow.x += cp.x * du[i];
+                derivativeRow.y += cp.y * du[i];
+                derivativeRow.z += cp.z * du[i];
+            }
+            result.position.x += row.x * bv[j];
+            result.position.y += row.y * bv[j];
+            result.position.z += row.z * bv[j];
+            result.du.x += derivativeRow.x * bv[j];
+            result.du.y += derivativeRow.y * bv[j];
+            result.du.z += derivativeRow.z * bv[j];
+            result.dv.x += row.x * dv[j];
+            result.dv.y += row.y * dv[j];
+            result.dv.z += row.z * dv[j];
+        }
+        return result;
+    }
+};
+
+// Knot span and basis values per sample of a uniformly sampled parameter,
+// so a grid finds each span and evaluates each basis once per row or
+// column instead of once per vertex
+template<int Degree>
+struct SpanBasisCache {
+    struct Entry {
+        int span;
+        float basis[Degree + 1];
+        float derivative[Degree + 1];
+    };
+
+    std::vector<Entry> entries;
+    int segments;
+
+    SpanBasisCache() : segments(0) {}
+
+    void build(const float* knots, int controlCount, int newSegments) {
+        segments = newSegments;
+        entries.resize(segments + 1);
+        float first = knots[Degree], last = knots[controlCount];
+        for (int s = 0; s <= segments; s++) {
+            float t = s == segments ? last : first + (last - first) * s / segments;
+            Entry& entry = entries[s];
+            entry.span = SplineBasis<Degree>::findSpan(knots, controlCount, t);
+            SplineBasis<Degree>::evaluate(knots, entry.span, t, entry.basis, entry.derivative);
+        }
+    }
+};
+
+// Non-owning view of a NURBS surface of fixed degrees: countU x countV
+// control points and weights (row-major, i * countV + j with i along u)
+// and a knot vector per direction
+template<int DegreeU, int DegreeV>
+struct NurbsSurface {
+    const Point3D* points;
+    const float* weights;
+    int countU, countV;
+    const float* knotsU;
+    const float* knotsV;
+
+    // Rational derivative: with A = sum w P N and W = sum w N,
+    // S = A / W and S' = (A' - W' S) / W
+    static SurfacePoint project(const float a[4], const float au[4], const float av[4]) {
+        SurfacePoint result;
+        float inverse = 1.0f / a[3];
+        result.position = Point3D(a[0] * inverse, a[1] * inverse, a[2] * inverse);
+        result.du = Point3D((au[0] - au[3] * result.position.x) * inverse, (au[1] - au[3] * result.position.y) * inverse,
+            (au[2] - au[3] * result.position.z) * inverse);
+        result.dv = Point3D((av[0] - av[3] * result.position.x) * inverse, (av[1] - av[3] * result.position.y) * inverse,
+            (av[2] - av[3] * result.position.z) * inverse);
+        return result;
+    }
+
+    // Homogeneous (w P, w) control points of span row spanU collapsed with
+    // the u weights into DegreeV + 1 points per column j, the same order of
+    // operations evaluate() and evaluateGrid() share
+    void collapseRow(int spanU, const float* bu, const float* du, int spanV, float row[DegreeV + 1][4],
+        float derivativeRow[DegreeV + 1][4]) const {
+        for (int j = 0; j <= DegreeV; j++) {
+            for (int c = 0; c < 4; c++) row[j][c] = derivativeRow[j][c] = 0.0f;
+            int column = spanV - DegreeV + j;
+            for (int i = 0; i <= DegreeU; i++) {
+                int index = (spanU - DegreeU + i) * countV + column;
+                const Point3D& cp = points[index];
+                float w = weights[index];
+                float h[4] = { cp.x * w, cp.y * w, cp.z * w, w };
+                for (int c = 0; c < 4; c++) {
+                    row[j][c] += h[c] * bu[i];
+                    derivativeRow[j][c] += h[c] * du[i];
+                }
+            }
+        }
+    }
+
+    static SurfacePoint combine(const float row[DegreeV + 1][4], const float derivativeRow[DegreeV + 1][4],
+        const float* bv, const float* dv) {
+        float a[4] = { 0, 0, 0, 0 }, au[4] = { 0, 0, 0, 0 }, av[4] = { 0, 0, 0, 0 };
+        for (int j = 0; j <= DegreeV; j++) {
+            for (int c = 0; c < 4; c++) {
+                a[c] += row[j][c] * bv[j];
+                au[c] += derivativeRow[j][c] * bv[j];
+                av[c] += row[j][c] * dv[j];
+            }
+        }
+        return project(a, au, av);
+    }
+
+    SurfacePoint evaluate(float u, float v) const {
+        float bu[DegreeU + 1], du[DegreeU + 1], bv[DegreeV + 1], dv[DegreeV + 1];
+        int spanU = SplineBasis<DegreeU>::findSpan(knotsU, countU, u);
+        int spanV = SplineBasis<DegreeV>::findSpan(knotsV, countV, v);
+        SplineBasis<DegreeU>::evaluate(knotsU, spanU, u, bu, du);
+        SplineBasis<DegreeV>::evaluate(knotsV, spanV, v, bv, dv);
+
+        float row[DegreeV + 1][4], derivativeRow[DegreeV + 1][4];
+        collapseRow(spanU, bu, du, spanV, row, derivativeRow);
+        return combine(row, derivativeRow, bv, dv);
+    }
+
+    // Calls write(i, j, point) for every vertex of the grid sampled by the
+    // caches; a u row is collapsed once per v span it crosses
+    template<class Writer>
+    void evaluateGrid(const SpanBasisCache<DegreeU>& cacheU, const SpanBasisCache<DegreeV>& cacheV, Writer write) const {
+        float row[DegreeV + 1][4], derivativeRow[DegreeV + 1][4];
+        for (int i = 0; i <= cacheU.segments; i++) {
+            const typename SpanBasisCache<DegreeU>::Entry& eu = cacheU.entries[i];
+            int collapsedSpan = -1;
+            for (int j = 0; j <= cacheV.segments; j++) {
+                const typename SpanBasisCache<DegreeV>::Entry& ev = cacheV.entries[j];
+                if (ev.span != collapsedSpan) {
+                    collapseRow(eu.span, eu.basis, eu.derivative, ev.span, row, derivativeRow);
+                    collapsedSpan = ev.span;
+                }
+                write(i, j, combine(row, derivativeRow, ev.basis, ev.derivative));
+            }
+        }
+    }
+};
+
+// Axis-aligned box
+struct Bounds {
+    Point3D min, max;
+
+    Bounds() : min(1e30f, 1e30f, 1e30f), max(-1e30f, -1e30f, -1e30f) {}
+
+    void add(const Point3D& p) {
+        min = Point3D(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Point3D(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    void add(const Bounds& other) {
+        add(other.min);
+        add(other.max);
+    }
+
+    Point3D center() const {
+        return Point3D((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f);
+    }
+};
+
+struct Ray {
+    Point3D origin;
+    Point3D direction;  // normalized
+    Point3D inverseDirection;
+
+    Ray() {}
+    Ray(const Point3D& origin, const Point3D& direction)
+        : origin(origin), direction(direction),
+        inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z) {}
+
+    // Slab test; on a hit, tEntry is the distance where the ray enters the box
+    bool intersects(const Bounds& box, float tMax, float& tEntry) const {
+        float t1 = (box.min.x - origin.x) * inverseDirection.x;
+        float t2 = (box.max.x - origin.x) * inverseDirection.x;
+        float tNear = std::min(t1, t2), tFar = std::max(t1, t2);
+
+        t1 = (box.min.y - origin.y) * inverseDirection.y;
+        t2 = (box.max.y - origin.y) * inverseDirection.y;
+        tNear = std::max(tNear, std::min(t1, t2));
+        tFar = std::min(tFar, std::max(t1, t2));
+
+        t1 = (box.min.z - origin.z) * inverseDirection.z;
+        t2 = (box.max.z - origin.z) * inverseDirection.z;
+        tNear = std::max(tNear, std::min(t1, t2));
+        tFar = std::min(tFar, std::max(t1, t2));
+
+        tEntry = std::max(tNear, 0.0f);
+        return tFar >= tEntry && tEntry <= tMax;
+    }
+};
+
+// One or more bicubic Bezier patches (16 control points each, row-major
+// i * 4 + j with i along u) tessellated into one shared interleaved vertex
+// buffer and index list. Patches are tessellated in parallel on the pool.
+class BezierPatch {
+public:
+    enum SimdLevel { SIMD_SCALAR, SIMD_SSE, SIMD_AVX, SIMD_LEVEL_COUNT };
+
+    // How each 4x4 control net is read: a Bezier patch, one span of a
+    // uniform cubic B-spline, or a rational (NURBS) patch with the inner
+    // control points weighted by NURBS_INNER_WEIGHT
+    enum SurfaceType { SURFACE_BEZIER, SURFACE_BSPLINE, SURFACE_NURBS, SURFACE_TYPE_COUNT };
+
+    // Ray hit: patch index, surface parameters, distance t along the ray
+    struct PatchHit {
+        int patch;
+        float u, v, t;
+        Point3D point;
+    };
+
+    // Interleaved vertex layout: position (3), normal (3), texcoord (2)
+    static const int VERTEX_STRIDE = 8;
+
+    // Boundary edges: u runs along EDGE_V0 / EDGE_V1, v along EDGE_U0 / EDGE_U1
+    enum Edge { EDGE_V0, EDGE_U1, EDGE_V1, EDGE_U0, EDGE_COUNT };
+
+    // Segments along u and v for the interior grid and along each boundary
+    // edge. An edge level only depends on that edge's control points, so a
+    // neighbouring patch sharing the edge picks the same level.
+    struct TessellationLevels {
+        int innerU, innerV;
+        int edges[EDGE_COUNT];
+
+        bool operator==(const TessellationLevels& other) const {
+            return innerU == other.innerU && innerV == other.innerV &&
+                std::equal(edges, edges + EDGE_COUNT, other.edges);
+        }
+        bool operator!=(const TessellationLevels& other) const { return !(*this == other); }
+
+        // Vertices: the full inner grid plus the interior points of each
+        // edge. Triangles: the inner grid minus its outer ring, plus one
+        // zipper band per edge (edge segments + inner ring segments).
+        int vertexCount() const {
+            int count = (innerU + 1) * (innerV + 1);
+            for (int e = 0; e < EDGE_COUNT; e++) count += edges[e] - 1;
+            return count;
+        }
+        int indexCount() const {
+            int triangles = 2 * (innerU - 2) * (innerV - 2) +
+                edges[EDGE_V0] + edges[EDGE_V1] + 2 * (innerU - 2) +
+                edges[EDGE_U0] + edges[EDGE_U1] + 2 * (innerV - 2);
+            return triangles * 3;
+        }
+    };
+
+private:
+    std::vector<Point3D> controlPoints;
+    std::vector<Point3D> restControlPoints;
+    std::vector<float> vertexData;
+    std::vector<int> indices;
+
+    // First vertex / index of each patch in the shared buffers, with a
+    // trailing entry holding the totals
+    std::vector<int> vertexOffsets;
+    std::vector<int> indexOffsets;
+
+    ThreadPool pool;
+
+    // Control points at the same position (a shared corner or edge of
+    // neighbouring patches) form a ring through weldNext, so an edit moves
+    // every copy and the surface stays joined
+    std::vector<int> weldNext;
+
+    // Patches whose control points were edited since the last update, and
+    // the vertex ranges [first, end) waiting for glBufferSubData
+    std::vector<char> dirtyPatches;
+    std::vector<int> dirtyPatchList;
+    std::vector<std::pair<int, int>> dirtyVertexRanges;
+    int lastUpdatePatches;
+    double lastUpdateMs;
+
+    // GPU copy of vertexData; tessellate() marks it for a full upload
+    GLuint vertexBuffer;
+    GLsizeiptr vertexBufferSize;
+    bool vertexBufferStale;
+    size_t lastUploadBytes;
+
+    // Uniform grids are also kept as one triangle strip per grid row,
+    // separated by the primitive restart index; adaptive meshes (with
+    // their zipper fans) are drawn from the triangle list
+    static const GLuint RESTART_INDEX = 0xFFFFFFFFu;
+    std::vector<GLuint> stripIndices;
+    GLuint indexBuffer;
+    bool indexBufferStale;
+    bool drawingStrips;
+
+    // Counters since the last printRenderStats()
+    struct RenderStats {
+        int frames;
+        int drawCalls;
+        long long indicesSubmitted;
+        long long listIndices;
+        long long immediateCalls;
+        int vertexUploads;
+        int indexUploads;
+        size_t bytesUploaded;
+    } stats;
+
+    void buildWeldRings() {
+        int count = (int)controlPoints.size();
+        std::vector<int> order(count);
+        for (int i = 0; i < count; i++) order[i] = i;
+        auto less = [this](int a, int b) {
+            const Point3D& p = controlPoints[a];
+            const Point3D& q = controlPoints[b];
+            if (p.x != q.x) return p.x < q.x;
+            if (p.y != q.y) return p.y < q.y;
+            return p.z < q.z;
+        };
+        std::sort(order.begin(), order.end(), less);
+
+        weldNext.resize(count);
+        for (int begin = 0; begin < count;) {
+            int end = begin + 1;
+            while (end < count && !less(order[begin], order[end])) end++;
+            for (int k = begin; k < end; k++) {
+                weldNext[order[k]] = order[k + 1 < end ? k + 1 : begin];
+            }
+            begin = end;
+        }
+    }
+
+    // Picking: every patch keeps the bounds of its control hull subdivided
+    // PICK_DEPTH times (a complete quadtree in (u, v), PICK_NODES boxes
+    // per patch), and a BVH over the patch roots finds candidate patches.
+    // Edits only refit the boxes of the patches they touched.
+    static const int PICK_DEPTH = 3;
+    static const int PICK_NODES = (1 + 4 + 16 + 64);
+    static const int PICK_LEAF_PATCHES = 4;
+
+    struct PickNode {
+        Bounds bounds;
+        int rightChild;  // left child follows the node
+        int first;       // leaves: range in pickOrder
+        int count;       // 0 for interior nodes
+    };
+
+    std::vector<Bounds> hullBounds;
+    std::vector<PickNode> pickNodes;
+    std::vector<int> pickOrder;
+    std::vector<char> pickDirtyFlags;
+    std::vector<int> pickDirtyPatches;
+    bool pickStale;
+    double lastPickBuildMs;
+    double lastPickUs;
+
+    static int pickNodeIndex(int level, int iu, int iv) {
+        return ((1 << (2 * level)) - 1) / 3 + (iu << level) + iv;
+    }
+
+    // Splits the homogeneous control net at the middle of u (alongU) or v
+    // with de Casteljau; the halves' control hulls bound their surfaces
+    static void splitHull(const float net[16][4], bool alongU, float first[16][4], float second[16][4]) {
+        for (int curve = 0; curve < 4; curve++) {
+            int index[4];
+            for (int k = 0; k < 4; k++) index[k] = alongU ? k * 4 + curve : curve * 4 + k;
+            for (int c = 0; c < 4; c++) {
+                float p0 = net[index[0]][c], p1 = net[index[1]][c], p2 = net[index[2]][c], p3 = net[index[3]][c];
+                float a = (p0 + p1) * 0.5f, b = (p1 + p2) * 0.5f, d = (p2 + p3) * 0.5f;
+                float e = (a + b) * 0.5f, f = (b + d) * 0.5f;
+                float middle = (e + f) * 0.5f;
+                first[index[0]][c] = p0;
+                first[index[1]][c] = a;
+                first[index[2]][c] = e;
+                first[index[3]][c] = middle;
+                second[index[0]][c] = middle;
+                second[index[1]][c] = f;
+                second[index[2]][c] = d;
+                second[index[3]][c] = p3;
+            }
+        }
+    }
+
+    void buildHullNodes(const float net[16][4], int level, int iu, int iv, Bounds* nodes) const {
+        Bounds& box = nodes[pickNodeIndex(level, iu, iv)];
+        box = Bounds();
+        for (int k = 0; k < 16; k++) {
+            box.add(Point3D(net[k][0] / net[k][3], net[k][1] / net[k][3], net[k][2] / net[k][3]));
+        }
+        // Room for rounding in the Newton step
+        float pad = 1e-4f * (box.max.x - box.min.x + box.max.y - box.min.y + box.max.z - box.min.z) + 1e-6f;
+        box.min = Point3D(box.min.x - pad, box.min.y - pad, box.min.z - pad);
+        box.max = Point3D(box.max.x + pad, box.max.y + pad, box.max.z + pad);
+        if (level == PICK_DEPTH) return;
+
+        float lowU[16][4], highU[16][4], children[2][2][16][4];
+        splitHull(net, true, lowU, highU);
+        splitHull(lowU, false, children[0][0], children[0][1]);
+        splitHull(highU, false, children[1][0], children[1][1]);
+        for (int a = 0; a < 2; a++) {
+            for (int b = 0; b < 2; b++) {
+                buildHullNodes(children[a][b], level + 1, iu * 2 + a, iv * 2 + b, nodes);
+            }
+        }
+    }
+
+    // The patch as a homogeneous Bezier net (w P, w): B-spline spans are
+    // converted to their Bezier points first
+    void buildPatchHull(int patch) {
+        const Point3D* net = &controlPoints[patch * 16];
+        float hull[16][4];
+        if (surfaceType == SURFACE_BSPLINE) {
+            // Uniform cubic B-spline to Bezier, once along each direction
+            static const float toBezier[4][4] = {
+                { 1.0f / 6, 4.0f / 6, 1.0f / 6, 0 }, { 0, 4.0f / 6, 2.0f / 6, 0 },
+                { 0, 2.0f / 6, 4.0f / 6, 0 }, { 0, 1.0f / 6, 4.0f / 6, 1.0f / 6 } };
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    Point3D p(0, 0, 0);
+                    for (int a = 0; a < 4; a++) {
+                        for (int b = 0; b < 4; b++) {
+                            float weight = toBezier[i][a] * toBezier[j][b];
+                            p.x += net[a * 4 + b].x * weight;
+                            p.y += net[a * 4 + b].y * weight;
+                            p.z += net[a * 4 + b].z * weight;
+                        }
+                    }
+                    hull[i * 4 + j][0] = p.x;
+                    hull[i * 4 + j][1] = p.y;
+                    hull[i * 4 + j][2] = p.z;
+                    hull[i * 4 + j][3] = 1.0f;
+                }
+            }
+        }
+        else {
+            for (int k = 0; k < 16; k++) {
+                float w = surfaceType == SURFACE_NURBS ? weights[patch * 16 + k] : 1.0f;
+                hull[k][0] = net[k].x * w;
+                hull[k][1] = net[k].y * w;
+                hull[k][2] = net[k].z * w;
+                hull[k][3] = w;
+            }
+        }
+        buildHullNodes(hull, 0, 0, 0, &hullBounds[patch * PICK_NODES]);
+    }
+
+    int buildPickNodes(int first, int count) {
+        int node = (int)pickNodes.size();
+        pickNodes.push_back(PickNode());
+        pickNodes[node].first = first;
+        pickNodes[node].count = count;
+        pickNodes[node].rightChild = -1;
+        if (count <= PICK_LEAF_PATCHES) return node;
+
+        // Median split on the widest axis of the patch centers
+        Bounds centers;
+        for (int k = first; k < first + count; k++) centers.add(hullBounds[pickOrder[k] * PICK_NODES].center());
+        Point3D extent(centers.max.x - centers.min.x, centers.max.y - centers.min.y, centers.max.z - centers.min.z);
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        auto key = [this, axis](int patch) {
+            Point3D c = hullBounds[patch * PICK_NODES].center();
+            return axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+        };
+        int half = count / 2;
+        std::nth_element(pickOrder.begin() + first, pickOrder.begin() + first + half, pickOrder.begin() + first + count,
+            [&key](int a, int b) { return key(a) < key(b); });
+
+        pickNodes[node].count = 0;
+        buildPickNodes(first, half);
+        int right = buildPickNodes(first + half, count - half);
+        pickNodes[node].rightChild = right;
+        return node;
+    }
+
+    // Children follow their parent, so a reverse sweep sees them first
+    void refitPickNodes() {
+        for (int n = (int)pickNodes.size() - 1; n >= 0; n--) {
+            PickNode& node = pickNodes[n];
+            node.bounds = Bounds();
+            if (node.count) {
+                for (int k = node.first; k < node.first + node.count; k++) node.bounds.add(hullBounds[pickOrder[k] * PICK_NODES]);
+            }
+            else {
+                node.bounds.add(pickNodes[n + 1].bounds);
+                node.bounds.add(pickNodes[node.rightChild].bounds);
+            }
+        }
+    }
+
+    void updatePickStructure() {
+        int patchCount = getPatchCount();
+        if (!pickStale && pickDirtyPatches.empty()) return;
+        auto start = std::chrono::high_resolution_clock::now();
+
+        if (pickStale) {
+            hullBounds.resize(patchCount * PICK_NODES);
+            pool.parallelFor(patchCount, [&](int begin, int end) {
+                for (int p = begin; p < end; p++) buildPatchHull(p);
+            }, 16);
+            pickOrder.resize(patchCount);
+            for (int p = 0; p < patchCount; p++) pickOrder[p] = p;
+            pickNodes.clear();
+            buildPickNodes(0, patchCount);
+        }
+        else {
+            for (int p : pickDirtyPatches) buildPatchHull(p);
+        }
+        refitPickNodes();
+        pickStale = false;
+        for (int p : pickDirtyPatches) pickDirtyFlags[p] = 0;
+        pickDirtyPatches.clear();
+        lastPickBuildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // Newton iteration on the ray as the intersection of two planes
+    // (Kajiya): F(u, v) = (n1 . S + d1, n2 . S + d2) = 0. Starts at (su, sv)
+    // and only accepts roots inside (a margin around) the hull leaf at
+    // (u0, v0), so neighbouring leaves don't report each other's roots.
+    bool newtonIntersect(const Point3D* net, const Ray& ray, float u0, float v0, float size, float su, float sv, PatchHit& hit) const {
+        const Point3D& d = ray.direction;
+        Point3D n1 = fabsf(d.x) > fabsf(d.y) && fabsf(d.x) > fabsf(d.z) ? Point3D(d.y, -d.x, 0) : Point3D(0, d.z, -d.y);
+        float length = sqrtf(n1.x * n1.x + n1.y * n1.y + n1.z * n1.z);
+        n1 = Point3D(n1.x / length, n1.y / length, n1.z / length);
+        Point3D n2(d.y * n1.z - d.z * n1.y, d.z * n1.x - d.x * n1.z, d.x * n1.y - d.y * n1.x);
+        auto dot = [](const Point3D& a, const Point3D& b) { return a.x * b.x + a.y * b.y + a.z * b.z; };
+        float d1 = -dot(n1, ray.origin), d2 = -dot(n2, ray.origin);
+
+        float u = su, v = sv;
+        for (int iteration = 0; iteration < 12; iteration++) {
+            SurfacePoint point = surfacePoint(net, u, v);
+            float f1 = dot(n1, point.position) + d1;
+            float f2 = dot(n2, point.position) + d2;
+            if (fabsf(f1) + fabsf(f2) < 1e-5f) {
+                float margin = size * 0.01f;
+                if (u < u0 - margin || u > u0 + size + margin || v < v0 - margin || v > v0 + size + margin) return false;
+                Point3D offset(point.position.x - ray.origin.x, point.position.y - ray.origin.y, point.position.z - ray.origin.z);
+                hit.t = dot(offset, ray.direction);
+                hit.u = u;
+                hit.v = v;
+                hit.point = point.position;
+                return hit.t > 0;
+            }
+
+            float a = dot(n1, point.du), b = dot(n1, point.dv);
+            float c = dot(n2, point.du), e = dot(n2, point.dv);
+            float determinant = a * e - b * c;
+            if (fabsf(determinant) < 1e-12f) return false;
+            u = std::min(1.0f, std::max(0.0f, u - (e * f1 - b * f2) / determinant));
+            v = std::min(1.0f, std::max(0.0f, v - (a * f2 - c * f1) / determinant));
+        }
+        return false;
+    }
+
+    // Walks one patch's hull quadtree nearest box first
+    void intersectPatch(int patch, const Ray& ray, PatchHit& best) const {
+        const Bounds* nodes = &hullBounds[patch * PICK_NODES];
+        struct Entry { int level, iu, iv; float t; };
+        Entry stack[4 * PICK_DEPTH + 1];
+        int size = 0;
+        float t;
+        if (ray.intersects(nodes[0], best.t, t)) stack[size++] = { 0, 0, 0, t };
+        while (size) {
+            Entry entry = stack[--size];
+            if (entry.t > best.t) continue;
+            if (entry.level == PICK_DEPTH) {
+                // A ray crossing a leaf at a grazing angle can hit it twice,
+                // and Newton from one seed converges to either root. Seed
+                // from the centre and the four quarter points and keep the
+                // nearest root.
+                static const float SEEDS[5][2] = { { 0.5f, 0.5f }, { 0.25f, 0.25f }, { 0.75f, 0.25f }, { 0.25f, 0.75f }, { 0.75f, 0.75f } };
+                float cell = 1.0f / (1 << PICK_DEPTH);
+                float u0 = entry.iu * cell, v0 = entry.iv * cell;
+                for (const auto& seed : SEEDS) {
+                    PatchHit hit;
+                    if (newtonIntersect(&controlPoints[patch * 16], ray, u0, v0, cell, u0 + seed[0] * cell, v0 + seed[1] * cell, hit) && hit.t < best.t) {
+                        hit.patch = patch;
+                        best = hit;
+                    }
+                }
+                continue;
+            }
+            // Push the children farthest first so the nearest pops next
+            Entry children[4];
+            int count = 0;
+            for (int a = 0; a < 2; a++) {
+                for (int b = 0; b < 2; b++) {
+                    Entry child = { entry.level + 1, entry.iu * 2 + a, entry.iv * 2 + b, 0.0f };
+                    if (ray.intersects(nodes[pickNodeIndex(child.level, child.iu, child.iv)], best.t, child.t)) children[count++] = child;
+                }
+            }
+            for (int k = 1; k < count; k++) {
+                Entry child = children[k];
+                int j = k;
+                for (; j > 0 && children[j - 1].t < child.t; j--) children[j] = children[j - 1];
+                children[j] = child;
+            }
+            for (int k = 0; k < count; k++) stack[size++] = children[k];
+        }
+    }
+
+    int resolution;
+    int indexResolution;
+    SimdLevel simdLevel;
+    SurfaceType surfaceType;
+
+    // Per control point; only SURFACE_NURBS reads them
+    std::vector<float> weights;
+    static const float NURBS_INNER_WEIGHT;
+
+    // Knots of one bicubic span over [0, 1], which makes the NURBS basis
+    // the Bernstein basis
+    static const float PATCH_KNOTS[8];
+    SimdLevel maxSimdLevel;
+    double lastTessellationMs;
+
+    // Bumped whenever controlPoints change, for consumers caching them
+    int controlPointsVersion;
+
+    // Screen-space adaptive tessellation (see chooseLevels), one set of
+    // levels per patch. indexResolution is ADAPTIVE_TOPOLOGY while the
+    // indices describe meshLevels.
+    static const int ADAPTIVE_TOPOLOGY = -1;
+    static const int MAX_LEVEL = 128;
+    bool adaptive;
+    float flatnessPixels;
+    float edgePixels;
+    int triangleBudget;
+    std::vector<TessellationLevels> levels;
+    std::vector<TessellationLevels> meshLevels;
+
+    // Cubic basis weights (Bernstein, or uniform B-spline for
+    // SURFACE_BSPLINE) and their derivatives per parameter sample
+    // s / segments, stored as basis[k * stride + s] so a batch of
+    // consecutive samples loads with one instruction
+    struct BasisTable {
+        int segments;
+        int stride;
+        bool bspline;
+        std::vector<float> basis;
+        std::vector<float> derivative;
+        std::vector<float> parameters;
+
+        BasisTable() : segments(0), stride(0), bspline(false) {}
+    };
+
+    static const float NORMAL_STEP;
+
+    // Indexed by segment count; filled before the parallel phase, read-only
+    // inside it
+    std::vector<BasisTable> basisTables;
+    std::vector<SpanBasisCache<3>> spanCaches;
+
+    const BasisTable& basisFor(int segments) {
+        if ((int)basisTables.size() <= segments) {
+            basisTables.resize(segments + 1);
+            spanCaches.resize(segments + 1);
+        }
+        bool bspline = surfaceType == SURFACE_BSPLINE;
+        if (bspline) buildBasisTable<UniformBSplineBasis<3>>(basisTables[segments], segments, bspline);
+        else buildBasisTable<BezierBasis<3>>(basisTables[segments], segments, bspline);
+        if (surfaceType == SURFACE_NURBS && spanCaches[segments].segments != segments) {
+            spanCaches[segments].build(PATCH_KNOTS, 4, segments);
+        }
+        return basisTables[segments];
+    }
+
+    template<class Basis>
+    static void buildBasisTable(BasisTable& table, int segments, bool bspline) {
+        if (table.segments == segments && table.bspline == bspline) return;
+
+        // Padded to a whole 8-lane batch
+        table.stride = (segments + 1 + 7) & ~7;
+        table.basis.assign(table.stride * 4, 0.0f);
+        table.derivative.assign(table.stride * 4, 0.0f);
+        table.parameters.assign(table.stride, 0.0f);
+        for (int s = 0; s <= segments; s++) {
+            float t = float(s) / segments;
+            float basis[Basis::ORDER], derivative[Basis::ORDER];
+            Basis::evaluate(t, basis, derivative);
+            table.parameters[s] = t;
+            for (int k = 0; k < 4; k++) {
+                table.basis[k * table.stride + s] = basis[k];
+                table.derivative[k * table.stride + s] = derivative[k];
+            }
+        }
+        table.segments = segments;
+        table.bspline = bspline;
+    }
+
+    NurbsSurface<3, 3> nurbsPatch(const Point3D* net) const {
+        NurbsSurface<3, 3> surface = { net, &weights[net - controlPoints.data()], 4, 4, PATCH_KNOTS, PATCH_KNOTS };
+        return surface;
+    }
+
+    // Bu * P: collapses the control grid net along u into 4 points, after
+    // which every vertex of the row is a 4-term sum along v. Weight k is at
+    // weights[k * stride].
+    static void collapseRow(const Point3D* net, const float* weights, int stride, Point3D row[4]) {
+        for (int j = 0; j < 4; j++) {
+            row[j] = Point3D(0, 0, 0);
+            for (int k = 0; k < 4; k++) {
+                const Point3D& cp = net[k * 4 + j];
+                float b = weights[k * stride];
+                row[j].x += cp.x * b;
+                row[j].y += cp.y * b;
+                row[j].z += cp.z * b;
+            }
+        }
+    }
+
+    static Point3D combine(const Point3D row[4], const float* weights, int stride) {
+        float b0 = weights[0];
+        float b1 = weights[stride];
+        float b2 = weights[2 * stride];
+        float b3 = weights[3 * stride];
+        return Point3D(row[0].x * b0 + row[1].x * b1 + row[2].x * b2 + row[3].x * b3,
+            row[0].y * b0 + row[1].y * b1 + row[2].y * b2 + row[3].y * b3,
+            row[0].z * b0 + row[1].z * b1 + row[2].z * b2 + row[3].z * b3);
+    }
+
+    // Unit normal of the surface spanned by origin->alongU and origin->alongV
+    static Point3D normalFromSteps(const Point3D& origin, const Point3D& alongU, const Point3D& alongV) {
+        Point3D du_vec = Point3D(alongU.x - origin.x, alongU.y - origin.y, alongU.z - origin.z);
+        Point3D dv_vec = Point3D(alongV.x - origin.x, alongV.y - origin.y, alongV.z - origin.z);
+        return normalFromTangents(du_vec, dv_vec);
+    }
+
+    // Unit normal dP/du x dP/dv
+    static Point3D normalFromTangents(const Point3D& du_vec, const Point3D& dv_vec) {
+        Point3D normal;
+        normal.x = du_vec.y * dv_vec.z - du_vec.z * dv_vec.y;
+        normal.y = du_vec.z * dv_vec.x - du_vec.x * dv_vec.z;
+        normal.z = du_vec.x * dv_vec.y - du_vec.y * dv_vec.x;
+
+        float length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+        if (length > 0) {
+            normal.x /= length;
+            normal.y /= length;
+            normal.z /= length;
+        }
+
+        return normal;
+    }
+
+    // Scalar kernel: the vertex at (u, v) given the u collapse row /
+    // derivativeRow and the v weights bv / dv (element k at k * stride)
+    static void writeVertex(const Point3D row[4], const Point3D derivativeRow[4], const float* bv, const float* dv,
+        int stride, float u, float v, float* out) {
+        Point3D vertex = combine(row, bv, stride);
+        Point3D normal = normalFromTangents(combine(derivativeRow, bv, stride), combine(row, dv, stride));
+
+        out[0] = vertex.x;
+        out[1] = vertex.y;
+        out[2] = vertex.z;
+        out[3] = normal.x;
+        out[4] = normal.y;
+        out[5] = normal.z;
+        //   = (u,v) 
+        out[6] = u;
+        out[7] = v;
+    }
+
+    static void writeSurfaceVertex(const SurfacePoint& point, float u, float v, float* out) {
+        Point3D normal = normalFromTangents(point.du, point.dv);
+        out[0] = point.position.x;
+        out[1] = point.position.y;
+        out[2] = point.position.z;
+        out[3] = normal.x;
+        out[4] = normal.y;
+        out[5] = normal.z;
+        out[6] = u;
+        out[7] = v;
+    }
+
+    static void writeGridVertex(const BasisTable& vt, const Point3D row[4], const Point3D derivativeRow[4], float u, int j, float* out) {
+        writeVertex(row, derivativeRow, &vt.basis[j], &vt.derivative[j], vt.stride, u, vt.parameters[j], out);
+    }
+
+    SurfacePoint surfacePoint(const Point3D* net, float u, float v) const {
+        switch (surfaceType) {
+        case SURFACE_BSPLINE: return TensorPatch<UniformBSplineBasis<3>, UniformBSplineBasis<3>>::evaluate(net, u, v);
+        case SURFACE_NURBS: return nurbsPatch(net).evaluate(u, v);
+        default: return TensorPatch<BezierBasis<3>, BezierBasis<3>>::evaluate(net, u, v);
+        }
+    }
+
+    // The vertex at an arbitrary (u, v) of the patch with control net net
+    void evaluatePoint(const Point3D* net, float u, float v, float* out) const {
+        writeSurfaceVertex(surfacePoint(net, u, v), u, v, out);
+    }
+
+    // Builds one patch's triangles into its slice of the index list.
+    // Vertex indices are patch-local (read from vertices) and written
+    // offset by baseVertex.
+    struct PatchMeshWriter {
+        const float* vertices;
+        int baseVertex;
+        int* out;
+
+        // Adds a triangle wound like the uniform grid's (counter-clockwise
+        // in the (u, v) plane, so dP/du x dP/dv faces the viewer)
+        void addTriangle(int a, int b, int c) {
+            const float* ta = &vertices[a * VERTEX_STRIDE + 6];
+            const float* tb = &vertices[b * VERTEX_STRIDE + 6];
+            const float* tc = &vertices[c * VERTEX_STRIDE + 6];
+            float area = (tb[0] - ta[0]) * (tc[1] - ta[1]) - (tb[1] - ta[1]) * (tc[0] - ta[0]);
+            if (area < 0) std::swap(b, c);
+            *out++ = baseVertex + a;
+            *out++ = baseVertex + b;
+            *out++ = baseVertex + c;
+        }
+
+        // Triangulates the band between a boundary edge and the matching
+        // side of the inner ring, walking both by their parameter along the
+        // edge (texcoord component axis). Both lists run in increasing
+        // parameter.
+        void zipper(const std::vector<int>& outer, const std::vector<int>& inner, int axis) {
+            size_t a = 0, b = 0;
+            while (a + 1 < outer.size() || b + 1 < inner.size()) {
+                bool advanceOuter = b + 1 >= inner.size() ||
+                    (a + 1 < outer.size() && vertices[outer[a + 1] * VERTEX_STRIDE + 6 + axis] <= vertices[inner[b + 1] * VERTEX_STRIDE + 6 + axis]);
+                if (advanceOuter) {
+                    addTriangle(outer[a], outer[a + 1], inner[b]);
+                    a++;
+                }
+                else {
+                    addTriangle(outer[a], inner[b + 1], inner[b]);
+                    b++;
+                }
+            }
+        }
+    };
+
+#ifdef BEZIER_SIMD
+    // The SIMD kernels repeat writeGridVertex() operation for operation (no FMA,
+    // true division), so every level produces bit-identical vertices. Each
+    // returns how many vertices of the row it wrote; the rest fall back to
+    // the scalar kernel.
+    static __m128 weightedSumSse(float c0, float c1, float c2, float c3, const __m128 w[4]) {
+        return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(c0), w[0]), _mm_mul_ps(_mm_set1_ps(c1), w[1])),
+            _mm_mul_ps(_mm_set1_ps(c2), w[2])), _mm_mul_ps(_mm_set1_ps(c3), w[3]));
+    }
+
+    static int evaluateRowSse(const BasisTable& vt, const Point3D row[4], const Point3D derivativeRow[4], float u, int count, float* out) {
+        int j = 0;
+        for (; j + 4 <= count; j += 4) {
+            __m128 b[4], d[4];
+            for (int k = 0; k < 4; k++) {
+                b[k] = _mm_loadu_ps(&vt.basis[k * vt.stride + j]);
+                d[k] = _mm_loadu_ps(&vt.derivative[k * vt.stride + j]);
+            }
+
+            __m128 px = weightedSumSse(row[0].x, row[1].x, row[2].x, row[3].x, b);
+            __m128 py = weightedSumSse(row[0].y, row[1].y, row[2].y, row[3].y, b);
+            __m128 pz = weightedSumSse(row[0].z, row[1].z, row[2].z, row[3].z, b);
+            __m128 ux = weightedSumSse(derivativeRow[0].x, derivativeRow[1].x, derivativeRow[2].x, derivativeRow[3].x, b);
+            __m128 uy = weightedSumSse(derivativeRow[0].y, derivativeRow[1].y, derivativeRow[2].y, derivativeRow[3].y, b);
+            __m128 uz = weightedSumSse(derivativeRow[0].z, derivativeRow[1].z, derivativeRow[2].z, derivativeRow[3].z, b);
+            __m128 vx = weightedSumSse(row[0].x, row[1].x, row[2].x, row[3].x, d);
+            __m128 vy = weightedSumSse(row[0].y, row[1].y, row[2].y, row[3].y, d);
+            __m128 vz = weightedSumSse(row[0].z, row[1].z, row[2].z, row[3].z, d);
+
+            __m128 nx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy));
+            __m128 ny = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz));
+            __m128 nz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx));
+            __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+            __m128 positive = _mm_cmpgt_ps(length, _mm_setzero_ps());
+            nx = _mm_or_ps(_mm_and_ps(positive, _mm_div_ps(nx, length)), _mm_andnot_ps(positive, nx));
+            ny = _mm_or_ps(_mm_and_ps(positive, _mm_div_ps(ny, length)), _mm_andnot_ps(positive, ny));
+            nz = _mm_or_ps(_mm_and_ps(positive, _mm_div_ps(nz, length)), _mm_andnot_ps(positive, nz));
+
+            __m128 tu = _mm_set1_ps(u);
+            __m128 tv = _mm_loadu_ps(&vt.parameters[j]);
+
+            // SoA -> interleaved: two 4x4 transposes give the two halves of
+            // each vertex
+            _MM_TRANSPOSE4_PS(px, py, pz, nx);
+            _MM_TRANSPOSE4_PS(ny, nz, tu, tv);
+            float* dst = out + j * VERTEX_STRIDE;
+            _mm_storeu_ps(dst, px);      _mm_storeu_ps(dst + 4, ny);
+            _mm_storeu_ps(dst + 8, py);  _mm_storeu_ps(dst + 12, nz);
+            _mm_storeu_ps(dst + 16, pz); _mm_storeu_ps(dst + 20, tu);
+            _mm_storeu_ps(dst + 24, nx); _mm_storeu_ps(dst + 28, tv);
+        }
+        return j;
+    }
+
+    BEZIER_AVX_TARGET static __m256 weightedSumAvx(float c0, float c1, float c2, float c3, const __m256 w[4]) {
+        return _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(c0), w[0]), _mm256_mul_ps(_mm256_set1_ps(c1), w[1])),
+            _mm256_mul_ps(_mm256_set1_ps(c2), w[2])), _mm256_mul_ps(_mm256_set1_ps(c3), w[3]));
+    }
+
+    BEZIER_AVX_TARGET static int evaluateRowAvx(const BasisTable& vt, const Point3D row[4], const Point3D derivativeRow[4], float u, int count, float* out) {
+        int j = 0;
+        for (; j + 8 <= count; j += 8) {
+            __m256 b[4], d[4];
+            for (int k = 0; k < 4; k++) {
+                b[k] = _mm256_loadu_ps(&vt.basis[k * vt.stride + j]);
+                d[k] = _mm256_loadu_ps(&vt.derivative[k * vt.stride + j]);
+            }
+
+            __m256 px = weightedSumAvx(row[0].x, row[1].x, row[2].x, row[3].x, b);
+            __m256 py = weightedSumAvx(row[0].y, row[1].y, row[2].y, row[3].y, b);
+            __m256 pz = weightedSumAvx(row[0].z, row[1].z, row[2].z, row[3].z, b);
+            __m256 ux = weightedSumAvx(derivativeRow[0].x, derivativeRow[1].x, derivativeRow[2].x, derivativeRow[3].x, b);
+            __m256 uy = weightedSumAvx(derivativeRow[0].y, derivativeRow[1].y, derivativeRow[2].y, derivativeRow[3].y, b);
+            __m256 uz = weightedSumAvx(derivativeRow[0].z, derivativeRow[1].z, derivativeRow[2].z, derivativeRow[3].z, b);
+            __m256 vx = weightedSumAvx(row[0].x, row[1].x, row[2].x, row[3].x, d);
+            __m256 vy = weightedSumAvx(row[0].y, row[1].y, row[2].y, row[3].y, d);
+            __m256 vz = weightedSumAvx(row[0].z, row[1].z, row[2].z, row[3].z, d);
+
+            __m256 nx = _mm256_sub_ps(_mm256_mul_ps(uy, vz), _mm256_mul_ps(uz, vy));
+            __m256 ny = _mm256_sub_ps(_mm256_mul_ps(uz, vx), _mm256_mul_ps(ux, vz));
+            __m256 nz = _mm256_sub_ps(_mm256_mul_ps(ux, vy), _mm256_mul_ps(uy, vx));
+            __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz)));
+            __m256 positive = _mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ);
+            nx = _mm256_blendv_ps(nx, _mm256_div_ps(nx, length), positive);
+            ny = _mm256_blendv_ps(ny, _mm256_div_ps(ny, length), positive);
+            nz = _mm256_blendv_ps(nz, _mm256_div_ps(nz, length), positive);
+
+            __m256 tu = _mm256_set1_ps(u);
+            __m256 tv = _mm256_loadu_ps(&vt.parameters[j]);
+
+            // SoA -> interleaved: 8x8 transpose, output k is vertex j + k
+            __m256 t0 = _mm256_unpacklo_ps(px, py), t1 = _mm256_unpackhi_ps(px, py);
+            __m256 t2 = _mm256_unpacklo_ps(pz, nx), t3 = _mm256_unpackhi_ps(pz, nx);
+            __m256 t4 = _mm256_unpacklo_ps(ny, nz), t5 = _mm256_unpackhi_ps(ny, nz);
+            __m256 t6 = _mm256_unpacklo_ps(tu, tv), t7 = _mm256_unpackhi_ps(tu, tv);
+            __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+            float* dst = out + j * VERTEX_STRIDE;
+            _mm256_storeu_ps(dst, _mm256_permute2f128_ps(s0, s4, 0x20));
+            _mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(s1, s5, 0x20));
+            _mm256_storeu_ps(dst + 16, _mm256_permute2f128_ps(s2, s6, 0x20));
+            _mm256_storeu_ps(dst + 24, _mm256_permute2f128_ps(s3, s7, 0x20));
+            _mm256_storeu_ps(dst + 32, _mm256_permute2f128_ps(s0, s4, 0x31));
+            _mm256_storeu_ps(dst + 40, _mm256_permute2f128_ps(s1, s5, 0x31));
+            _mm256_storeu_ps(dst + 48, _mm256_permute2f128_ps(s2, s6, 0x31));
+            _mm256_storeu_ps(dst + 56, _mm256_permute2f128_ps(s3, s7, 0x31));
+        }
+        return j;
+    }
+#endif
+
+    static SimdLevel detectSimdLevel() {
+#ifdef BEZIER_SIMD
+#if defined(_MSC_VER)
+        // AVX needs both the CPU bit and the OS saving YMM state
+        int info[4];
+        __cpuid(info, 1);
+        bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+        if ((info[2] & (1 << 28)) && osSavesYmm) return SIMD_AVX;
+#else
+        if (__builtin_cpu_supports("avx")) return SIMD_AVX;
+#endif
+        return SIMD_SSE;
+#else
+        return SIMD_SCALAR;
+#endif
+    }
+
+public:
+    BezierPatch() : lastUpdatePatches(0), lastUpdateMs(0.0), vertexBuffer(0), vertexBufferSize(0), vertexBufferStale(true), lastUploadBytes(0),
+        indexBuffer(0), indexBufferStale(true), drawingStrips(false), stats(),
+        pickStale(true), lastPickBuildMs(0.0), lastPickUs(0.0),
+        resolution(12), indexResolution(0), lastTessellationMs(0.0), controlPointsVersion(0),
+        adaptive(false), flatnessPixels(0.5f), edgePixels(16.0f), triangleBudget(20000) { // 12x12  
+        maxSimdLevel = simdLevel = detectSimdLevel();
+        surfaceType = SURFACE_BEZIER;
+        initializeControlPoints();
+    }
+
+    static TessellationLevels uniformLevels(int segments) {
+        TessellationLevels result;
+        result.innerU = result.innerV = segments;
+        std::fill(result.edges, result.edges + EDGE_COUNT, segments);
+        return result;
+    }
+
+    int getResolution() const { return resolution; }
+
+    void setResolution(int newResolution) {
+        resolution = std::max(1, newResolution);
+        tessellate();
+    }
+
+    int getPatchCount() const { return (int)controlPoints.size() / 16; }
+    int getThreadCount() const { return pool.getThreadCount(); }
+    ThreadPool& getThreadPool() { return pool; }
+
+    void setThreadCount(int threads) {
+        pool.setThreadCount(threads);
+    }
+
+    bool isAdaptive() const { return adaptive; }
+    float getEdgePixels() const { return edgePixels; }
+    float getFlatnessPixels() const { return flatnessPixels; }
+    const std::vector<Point3D>& getControlPoints() const { return controlPoints; }
+    int getControlPointsVersion() const { return controlPointsVersion; }
+    int getTriangleBudget() const { return triangleBudget; }
+    int getTriangleCount() const { return (int)indices.size() / 3; }
+
+    void setAdaptive(bool enabled) {
+        adaptive = enabled;
+        if (!adaptive) levels.assign(getPatchCount(), uniformLevels(resolution));
+        tessellate();
+    }
+
+    void setEdgePixels(float pixels) {
+        edgePixels = std::max(2.0f, std::min(256.0f, pixels));
+    }
+
+    void setTriangleBudget(int budget) {
+        triangleBudget = std::max(8, budget);
+    }
+
+    // Segments for one cubic control polygon given in pixels: Wang's bound
+    // for a flatness tolerance of flatnessPixels, or the polygon length
+    // (an upper bound on the curve length) over edgePixels, whichever is
+    // larger
+    float curveLevel(const float q[4][2]) const {
+        float length = 0.0f, secondDifference = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            length += sqrtf((q[k + 1][0] - q[k][0]) * (q[k + 1][0] - q[k][0]) + (q[k + 1][1] - q[k][1]) * (q[k + 1][1] - q[k][1]));
+        }
+        for (int k = 0; k < 2; k++) {
+            float dx = q[k + 2][0] - 2.0f * q[k + 1][0] + q[k][0];
+            float dy = q[k + 2][1] - 2.0f * q[k + 1][1] + q[k][1];
+            secondDifference = std::max(secondDifference, sqrtf(dx * dx + dy * dy));
+        }
+        float flatness = sqrtf(0.75f * secondDifference / flatnessPixels);
+        return std::max(flatness, length / edgePixels);
+    }
+
+    // Unscaled levels of one patch from its control net projected with the
+    // current OpenGL matrices (column-major) and viewport: each of the 4
+    // control curves along u and along v gets a level. Curves with a point
+    // behind the eye, where projection is meaningless, get MAX_LEVEL.
+    void measureCurves(const Point3D* net, const float modelview[16], const float projection[16], const int viewport[4],
+        float alongU[4], float alongV[4]) const {
+        float screen[16][2];
+        bool behind[16];
+        for (int n = 0; n < 16; n++) {
+            const Point3D& p = net[n];
+            float eye[4], clip[4];
+            for (int r = 0; r < 4; r++) {
+                eye[r] = modelview[r] * p.x + modelview[4 + r] * p.y + modelview[8 + r] * p.z + modelview[12 + r];
+            }
+            for (int r = 0; r < 4; r++) {
+                clip[r] = projection[r] * eye[0] + projection[4 + r] * eye[1] + projection[8 + r] * eye[2] + projection[12 + r] * eye[3];
+            }
+            behind[n] = clip[3] <= 1e-4f;
+            float w = std::max(clip[3], 1e-4f);
+            screen[n][0] = viewport[0] + (clip[0] / w * 0.5f + 0.5f) * viewport[2];
+            screen[n][1] = viewport[1] + (clip[1] / w * 0.5f + 0.5f) * viewport[3];
+        }
+
+        for (int c = 0; c < 4; c++) {
+            float q[4][2];
+            bool clipped = false;
+            for (int k = 0; k < 4; k++) {
+                q[k][0] = screen[k * 4 + c][0];
+                q[k][1] = screen[k * 4 + c][1];
+                clipped = clipped || behind[k * 4 + c];
+            }
+            alongU[c] = clipped ? float(MAX_LEVEL) : curveLevel(q);
+            clipped = false;
+            for (int k = 0; k < 4; k++) {
+                q[k][0] = screen[c * 4 + k][0];
+                q[k][1] = screen[c * 4 + k][1];
+                clipped = clipped || behind[c * 4 + k];
+            }
+            alongV[c] = clipped ? float(MAX_LEVEL) : curveLevel(q);
+        }
+    }
+
+    // Per-edge and interior levels of every patch: the boundary curves give
+    // the edge levels and the largest curve of each direction the interior
+    // level. If the surface would exceed triangleBudget, every level of
+    // every patch is scaled by the same factor, which keeps shared edges in
+    // agreement.
+    void chooseLevels(const float modelview[16], const float projection[16], const int viewport[4],
+        std::vector<TessellationLevels>& result) {
+        int patchCount = getPatchCount();
+        std::vector<float> curves(patchCount * 8);
+        pool.parallelFor(patchCount, [&](int begin, int end) {
+            for (int p = begin; p < end; p++) {
+                measureCurves(&controlPoints[p * 16], modelview, projection, viewport, &curves[p * 8], &curves[p * 8 + 4]);
+            }
+        }, 64);
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+        float estimate = 0.0f;
+        for (int p = 0; p < patchCount; p++) {
+            const float* alongU = &curves[p * 8];
+            const float* alongV = &curves[p * 8 + 4];
+            estimate += 2.0f * std::max(*std::max_element(alongU, alongU + 4), 2.0f) * std::max(*std::max_element(alongV, alongV + 4), 2.0f);
+        }
+        float scale = estimate > triangleBudget ? sqrtf(triangleBudget / estimate) : 1.0f;
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        auto quantize = [scale](float level, int minimum) {
+            return std::max(minimum, std::min(MAX_LEVEL, (int)ceilf(level * scale)));
+        };
+        result.resize(patchCount);
+        for (int p = 0; p < patchCount; p++) {
+            const float* alongU = &curves[p * 8];
+            const float* alongV = &curves[p * 8 + 4];
+            TessellationLevels& l = result[p];
+            // The interior needs 2 segments so the inner ring exists
+            l.innerU = quantize(*std::max_element(alongU, alongU + 4), 2);
+            l.innerV = quantize(*std::max_element(alongV, alongV + 4), 2);
+            l.edges[EDGE_V0] = quantize(alongU[0], 1);
+            l.edges[EDGE_V1] = quantize(alongU[3], 1);
+            l.edges[EDGE_U0] = quantize(alongV[0], 1);
+            l.edges[EDGE_U1] = quantize(alongV[3], 1);
+        }
+    }
 
-        std::cout << "Texture created: " << width << "x" << height << std::endl;
-        return true;
+    // Re-tessellates when the view changed the adaptive levels
+    void updateAdaptive(const float modelview[16], const float projection[16], const int viewport[4]) {
+        if (!adaptive) return;
+
+        std::vector<TessellationLevels> chosen;
+        chooseLevels(modelview, projection, viewport, chosen);
+        if (chosen == levels) return;
+
+        levels.swap(chosen);
+        tessellate(false);
+        std::cout << "Adaptive tessellation: ";
+        if (getPatchCount() == 1) {
+            const TessellationLevels& l = levels[0];
+            std::cout << "inner " << l.innerU << "x" << l.innerV << ", edges "
+                << l.edges[EDGE_V0] << "/" << l.edges[EDGE_U1] << "/" << l.edges[EDGE_V1] << "/" << l.edges[EDGE_U0] << ", ";
+        }
+        else {
+            std::cout << getPatchCount() << " patches, ";
+        }
+        std::cout << getTriangleCount() << " triangles (budget " << triangleBudget << ") in " << lastTessellationMs << " ms" << std::endl;
     }
 
-    void bind() {
-        glBindTexture(GL_TEXTURE_2D, textureID);
+    SimdLevel getSimdLevel() const { return simdLevel; }
+    SimdLevel getMaxSimdLevel() const { return maxSimdLevel; }
+    double getLastTessellationMs() const { return lastTessellationMs; }
+
+    void setSimdLevel(SimdLevel level) {
+        simdLevel = std::min(level, maxSimdLevel);
     }
 
-    GLuint getID() const { return textureID; }
-};
+    SurfaceType getSurfaceType() const { return surfaceType; }
 
-class BezierPatch {
-private:
-    std::vector<Point3D> controlPoints;
-    std::vector<Point3D> vertices;
-    std::vector<Point3D> normals;
-    std::vector<float> texCoords;
-    std::vector<int> indices;
+    void setSurfaceType(SurfaceType type) {
+        surfaceType = type;
+        pickStale = true;
+        tessellate();
+    }
 
-    int resolution;
+    static const char* surfaceTypeName(SurfaceType type) {
+        switch (type) {
+        case SURFACE_BSPLINE: return "uniform cubic B-spline";
+        case SURFACE_NURBS: return "NURBS";
+        default: return "Bezier";
+        }
+    }
 
-public:
-    BezierPatch() : resolution(12) { // 12x12  
-        initializeControlPoints();
+    static const char* simdLevelName(SimdLevel level) {
+        switch (level) {
+        case SIMD_SSE: return "SSE";
+        case SIMD_AVX: return "AVX";
+        default: return "scalar";
+        }
     }
 
     void initializeControlPoints() {
@@ -109,17 +1676,288 @@ public:
             // Row 3
             Point3D(-1.5f, 0.0f, 1.5f), Point3D(-0.5f, 2.0f, 1.5f), Point3D(0.5f, 2.0f, 1.5f), Point3D(1.5f, 0.0f, 1.5f)
         };
+        setControlPoints(controlPoints);
+    }
+
+    void setControlPoints(const std::vector<Point3D>& points) {
+        controlPoints = points;
+        restControlPoints = points;
+        levels.assign(getPatchCount(), uniformLevels(resolution));
+        dirtyPatches.assign(getPatchCount(), 0);
+        pickDirtyFlags.assign(getPatchCount(), 0);
+        pickDirtyPatches.clear();
+        weights.assign(points.size(), 1.0f);
+        for (int p = 0; p < getPatchCount(); p++) {
+            for (int index : { 5, 6, 9, 10 }) weights[p * 16 + index] = NURBS_INNER_WEIGHT;
+        }
+        dirtyPatchList.clear();
+        buildWeldRings();
+        pickStale = true;
+        controlPointsVersion++;
         tessellate();
     }
 
-    float bernstein(int i, int n, float t) {
-        float binomial = 1.0f;
-        for (int j = 1; j <= i; j++) {
-            binomial *= float(n - j + 1) / float(j);
+    const Point3D& getControlPoint(int index) const { return controlPoints[index]; }
+    int getLastUpdatePatches() const { return lastUpdatePatches; }
+    double getLastUpdateMs() const { return lastUpdateMs; }
+
+    // Compares what was sent per frame with what immediate mode (one
+    // glNormal3f/glTexCoord2f/glVertex3f per index, one glBegin/glEnd per
+    // patch) and a plain client-side index list would need
+    void printRenderStats() {
+        int frames = std::max(stats.frames, 1);
+        double submitted = (double)stats.indicesSubmitted / frames;
+        double listIndices = (double)stats.listIndices / frames;
+        std::cout << "Render stats over " << stats.frames << " frames: " << (drawingStrips ? "triangle strips" : "triangle list")
+            << ", " << (double)stats.drawCalls / frames << " draw calls and " << submitted << " indices per frame" << std::endl;
+        std::cout << "  immediate mode would need " << (double)stats.immediateCalls / frames << " GL calls and "
+            << listIndices << " vertices (" << listIndices * VERTEX_STRIDE * sizeof(float) / 1024 << " KB) per frame" << std::endl;
+        std::cout << "  index list: " << listIndices << " indices per frame, strips save "
+            << (listIndices > 0 ? 100.0 * (1.0 - submitted / listIndices) : 0.0) << "%" << std::endl;
+        std::cout << "  uploads: " << stats.vertexUploads << " vertex, " << stats.indexUploads << " index, "
+            << stats.bytesUploaded / 1024 << " KB in total (mesh is " << vertexData.size() * sizeof(float) / 1024 << " KB)" << std::endl;
+        stats = RenderStats();
+    }
+
+    // Index of the first copy of a welded control point, so each distinct
+    // point can be visited once
+    int weldLeader(int index) const {
+        int leader = index;
+        for (int k = weldNext[index]; k != index; k = weldNext[k]) leader = std::min(leader, k);
+        return leader;
+    }
+
+    // Moves a control point and its welded copies and marks their patches
+    // dirty; updateDirtyPatches() re-evaluates them. The edit also becomes
+    // the animation's rest position.
+    void moveControlPoint(int index, const Point3D& position) {
+        int k = index;
+        do {
+            controlPoints[k] = position;
+            restControlPoints[k] = position;
+            int patch = k / 16;
+            if (!pickDirtyFlags[patch]) {
+                pickDirtyFlags[patch] = 1;
+                pickDirtyPatches.push_back(patch);
+            }
+            if (!dirtyPatches[patch]) {
+                dirtyPatches[patch] = 1;
+                dirtyPatchList.push_back(patch);
+            }
+            k = weldNext[k];
+        } while (k != index);
+        controlPointsVersion++;
+    }
+
+    // Re-evaluates only the dirty patches, in place and in parallel. Every
+    // sample of a bicubic patch depends on all 16 of its control points, so
+    // a patch is the unit of work; neighbours are only touched through
+    // welded copies. The topology does not change, so indices are kept.
+    void updateDirtyPatches() {
+        if (dirtyPatchList.empty()) return;
+        auto start = std::chrono::high_resolution_clock::now();
+
+        std::sort(dirtyPatchList.begin(), dirtyPatchList.end());
+        pool.parallelFor((int)dirtyPatchList.size(), [&](int begin, int end) {
+            for (int n = begin; n < end; n++) {
+                int p = dirtyPatchList[n];
+                const Point3D* net = &controlPoints[p * 16];
+                float* vertices = &vertexData[vertexOffsets[p] * VERTEX_STRIDE];
+                if (adaptive) {
+                    buildAdaptivePatch(net, levels[p], vertices, vertexOffsets[p], NULL);
+                }
+                else {
+                    evaluateGrid(net, basisTables[resolution], basisTables[resolution], vertices);
+                }
+            }
+        }, 4);
+
+        // Neighbouring patches are adjacent in the buffer, so coalesce
+        for (int p : dirtyPatchList) {
+            dirtyPatches[p] = 0;
+            if (!dirtyVertexRanges.empty() && dirtyVertexRanges.back().second == vertexOffsets[p]) {
+                dirtyVertexRanges.back().second = vertexOffsets[p + 1];
+            }
+            else {
+                dirtyVertexRanges.push_back(std::make_pair(vertexOffsets[p], vertexOffsets[p + 1]));
+            }
+        }
+        lastUpdatePatches = (int)dirtyPatchList.size();
+        dirtyPatchList.clear();
+        lastUpdateMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // Nearest hit of the ray on the surface. The pick structure is rebuilt
+    // (or refit after edits) first when needed.
+    bool intersect(const Ray& ray, PatchHit& hit) {
+        updatePickStructure();
+        auto start = std::chrono::high_resolution_clock::now();
+
+        hit.patch = -1;
+        hit.t = 1e30f;
+        int stack[64];
+        int size = 0;
+        float t;
+        if (!pickNodes.empty() && ray.intersects(pickNodes[0].bounds, hit.t, t)) stack[size++] = 0;
+        while (size) {
+            const PickNode& node = pickNodes[stack[--size]];
+            if (!ray.intersects(node.bounds, hit.t, t)) continue;
+            if (node.count) {
+                for (int k = node.first; k < node.first + node.count; k++) intersectPatch(pickOrder[k], ray, hit);
+                continue;
+            }
+            int left = int(&node - pickNodes.data()) + 1;
+            float tLeft, tRight;
+            bool hitLeft = ray.intersects(pickNodes[left].bounds, hit.t, tLeft);
+            bool hitRight = ray.intersects(pickNodes[node.rightChild].bounds, hit.t, tRight);
+            // Nearer child on top
+            if (hitLeft && hitRight && tLeft < tRight) {
+                stack[size++] = node.rightChild;
+                stack[size++] = left;
+            }
+            else {
+                if (hitLeft) stack[size++] = left;
+                if (hitRight) stack[size++] = node.rightChild;
+            }
+        }
+
+        lastPickUs = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+        return hit.patch >= 0;
+    }
+
+    // The hit patch's control point closest to the hit point, as the first
+    // of its welded copies
+    int nearestControlPoint(const PatchHit& hit) const {
+        int nearest = -1;
+        float nearestDistance = 1e30f;
+        for (int k = hit.patch * 16; k < hit.patch * 16 + 16; k++) {
+            const Point3D& cp = controlPoints[k];
+            float dx = cp.x - hit.point.x, dy = cp.y - hit.point.y, dz = cp.z - hit.point.z;
+            float distance = dx * dx + dy * dy + dz * dz;
+            if (distance < nearestDistance) {
+                nearestDistance = distance;
+                nearest = k;
+            }
+        }
+        return weldLeader(nearest);
+    }
+
+    double getLastPickUs() const { return lastPickUs; }
+    double getLastPickBuildMs() const { return lastPickBuildMs; }
+
+    size_t getPendingUploadBytes() const {
+        if (vertexBufferStale) return vertexData.size() * sizeof(float);
+        size_t bytes = 0;
+        for (const std::pair<int, int>& range : dirtyVertexRanges) {
+            bytes += (range.second - range.first) * VERTEX_STRIDE * sizeof(float);
+        }
+        return bytes;
+    }
+
+    // Loads a surface in the BPT text format: the patch count, then per
+    // patch a "3 3" degree line and 16 "x y z" lines. The model is centred
+    // on the camera target and scaled to the size of the built-in patch.
+    // The file is read in one go and the patches parsed in parallel.
+    bool loadFromFile(const char* path) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cout << "Cannot open patch file " << path << std::endl;
+            return false;
+        }
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        // Non-empty lines only, so blank separators are tolerated
+        std::vector<const char*> lines;
+        for (size_t pos = 0; pos < text.size();) {
+            size_t end = text.find('\n', pos);
+            if (end == std::string::npos) end = text.size();
+            if (text.find_first_not_of(" \t\r", pos) < end) lines.push_back(text.c_str() + pos);
+            pos = end + 1;
+        }
+
+        int patchCount = lines.empty() ? 0 : atoi(lines[0]);
+        if (patchCount <= 0 || (int)lines.size() < 1 + patchCount * 17) {
+            std::cout << "Malformed patch file " << path << std::endl;
+            return false;
+        }
+
+        std::vector<Point3D> points(patchCount * 16);
+        std::atomic<int> badPatches(0);
+        pool.parallelFor(patchCount, [&](int begin, int end) {
+            for (int p = begin; p < end; p++) {
+                const char* header = lines[1 + p * 17];
+                char* next;
+                long degreeU = strtol(header, &next, 10);
+                long degreeV = strtol(next, NULL, 10);
+                if (degreeU != 3 || degreeV != 3) {
+                    badPatches++;
+                    continue;
+                }
+                for (int n = 0; n < 16; n++) {
+                    const char* line = lines[2 + p * 17 + n];
+                    char* cursor;
+                    Point3D& point = points[p * 16 + n];
+                    point.x = strtof(line, &cursor);
+                    point.y = strtof(cursor, &cursor);
+                    point.z = strtof(cursor, NULL);
+                }
+            }
+        }, 16);
+        if (badPatches > 0) {
+            std::cout << "Patch file " << path << ": " << badPatches << " patches are not bicubic" << std::endl;
+            return false;
+        }
+
+        Point3D low = points[0], high = points[0];
+        for (const Point3D& p : points) {
+            low = Point3D(std::min(low.x, p.x), std::min(low.y, p.y), std::min(low.z, p.z));
+            high = Point3D(std::max(high.x, p.x), std::max(high.y, p.y), std::max(high.z, p.z));
+        }
+        float extent = std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+        float scale = extent > 0 ? 3.0f / extent : 1.0f;
+        for (Point3D& p : points) {
+            p = Point3D((p.x - (low.x + high.x) * 0.5f) * scale,
+                (p.y - (low.y + high.y) * 0.5f) * scale + 1.5f,
+                (p.z - (low.z + high.z) * 0.5f) * scale);
+        }
+
+        double loadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "Loaded " << patchCount << " patches from " << path << " in " << loadMs << " ms ("
+            << pool.getThreadCount() << " threads)" << std::endl;
+        setControlPoints(points);
+        return true;
+    }
+
+    // Moves the four inner control points of every patch up and down
+    // around their rest positions and re-tessellates. Boundary control
+    // points stay put, so neighbouring patches remain joined.
+    void animate(float seconds) {
+        const int inner[4] = { 5, 6, 9, 10 };
+        for (size_t base = 0; base < controlPoints.size(); base += 16) {
+            for (int k = 0; k < 4; k++) {
+                int index = (int)base + inner[k];
+                controlPoints[index].y = restControlPoints[index].y + 1.5f * sinf(seconds * 2.0f + k * 1.57f);
+            }
         }
-        return binomial * powf(t, i) * powf(1 - t, n - i);
+        pickStale = true;
+        controlPointsVersion++;
+        tessellate(false);
+    }
+
+    void resetAnimation() {
+        controlPoints = restControlPoints;
+        pickStale = true;
+        controlPointsVersion++;
+        tessellate(false);
+    }
+
+    static float bernstein(int i, int n, float t) {
+        return float(binomial(n, i)) * powf(t, i) * powf(1 - t, n - i);
     }
 
+    // Point of the first patch
     Point3D evaluate(float u, float v) {
         Point3D result(0, 0, 0);
         for (int i = 0; i < 4; i++) {
@@ -135,101 +1973,667 @@ public:
         return result;
     }
 
+    // Forward-difference normal; kept as the reference for benchmark().
+    // Samples past the patch when u or v is 1.
     Point3D calculateNormal(float u, float v) {
-        float du = 0.01f;
-        float dv = 0.01f;
+        float du = NORMAL_STEP;
+        float dv = NORMAL_STEP;
 
         Point3D p1 = evaluate(u, v);
         Point3D p2 = evaluate(u + du, v);
         Point3D p3 = evaluate(u, v + dv);
 
-        Point3D du_vec = Point3D(p2.x - p1.x, p2.y - p1.y, p2.z - p1.z);
-        Point3D dv_vec = Point3D(p3.x - p1.x, p3.y - p1.y, p3.z - p1.z);
-
-        Point3D normal;
-        normal.x = du_vec.y * dv_vec.z - du_vec.z * dv_vec.y;
-        normal.y = du_vec.z * dv_vec.x - du_vec.x * dv_vec.z;
-        normal.z = du_vec.x * dv_vec.y - du_vec.y * dv_vec.x;
+        return normalFromSteps(p1, p2, p3);
+    }
 
-        float length = sqrtf(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-        if (length > 0) {
-            normal.x /= length;
-            normal.y /= length;
-            normal.z /= length;
+    // Positions, exact normals and texture coordinates of a ut.segments x
+    // vt.segments grid of the patch with control net net, written straight
+    // into the interleaved vertex buffer at out
+    void evaluateGrid(const Point3D* net, const BasisTable& ut, const BasisTable& vt, float* out) const {
+        int rowLength = vt.segments + 1;
+
+        // Rational patches take the generic path with cached spans
+        if (surfaceType == SURFACE_NURBS) {
+            nurbsPatch(net).evaluateGrid(spanCaches[ut.segments], spanCaches[vt.segments], [&](int i, int j, const SurfacePoint& point) {
+                writeSurfaceVertex(point, ut.parameters[i], vt.parameters[j], out + (i * rowLength + j) * VERTEX_STRIDE);
+            });
+            return;
         }
 
-        return normal;
+        // Iterative evaluation (not recursive): per row, Bu * P and Bu' * P,
+        // then the position and both partials as Bv-weighted sums
+        for (int i = 0; i <= ut.segments; i++) {
+            float u = float(i) / ut.segments;
+            Point3D row[4], derivativeRow[4];
+            collapseRow(net, &ut.basis[i], ut.stride, row);
+            collapseRow(net, &ut.derivative[i], ut.stride, derivativeRow);
+
+            float* rowOut = out + i * rowLength * VERTEX_STRIDE;
+            int j = 0;
+#ifdef BEZIER_SIMD
+            if (simdLevel == SIMD_AVX) j = evaluateRowAvx(vt, row, derivativeRow, u, rowLength, rowOut);
+            else if (simdLevel == SIMD_SSE) j = evaluateRowSse(vt, row, derivativeRow, u, rowLength, rowOut);
+#endif
+            for (; j < rowLength; j++) {
+                writeGridVertex(vt, row, derivativeRow, u, j, rowOut + j * VERTEX_STRIDE);
+            }
+        }
     }
 
-    void tessellate() {
-        vertices.clear();
-        normals.clear();
-        texCoords.clear();
-        indices.clear();
-
-        // Iterative evaluation (not recursive)
-        for (int i = 0; i <= resolution; i++) {
-            float u = float(i) / resolution;
-            for (int j = 0; j <= resolution; j++) {
-                float v = float(j) / resolution;
+    // Interior grid at innerU x innerV without its outermost ring of cells;
+    // each boundary edge gets its own level and is zipped to the inner
+    // ring, so the boundary only depends on the edge level. Vertices go to
+    // vertices (patch-local, layout as in TessellationLevels::vertexCount),
+    // indices to indexOut when it is not NULL.
+    void buildAdaptivePatch(const Point3D* net, const TessellationLevels& l, float* vertices, int baseVertex, int* indexOut) const {
+        int nu = l.innerU, nv = l.innerV;
+        evaluateGrid(net, basisTables[nu], basisTables[nv], vertices);
+        auto grid = [nv](int i, int j) { return i * (nv + 1) + j; };
+
+        int next = (nu + 1) * (nv + 1);
+        std::vector<int> edgeVertices[EDGE_COUNT];
+        for (int e = 0; e < EDGE_COUNT; e++) {
+            int segments = l.edges[e];
+            std::vector<int>& edge = edgeVertices[e];
+            for (int k = 0; k <= segments; k++) {
+                float t = float(k) / segments;
+                bool first = k == 0, last = k == segments;
+                int corner = -1;
+                float u = 0.0f, v = 0.0f;
+                switch (e) {
+                case EDGE_V0: corner = first ? grid(0, 0) : last ? grid(nu, 0) : -1; u = t; v = 0.0f; break;
+                case EDGE_V1: corner = first ? grid(0, nv) : last ? grid(nu, nv) : -1; u = t; v = 1.0f; break;
+                case EDGE_U0: corner = first ? grid(0, 0) : last ? grid(0, nv) : -1; u = 0.0f; v = t; break;
+                case EDGE_U1: corner = first ? grid(nu, 0) : last ? grid(nu, nv) : -1; u = 1.0f; v = t; break;
+                }
+                if (corner < 0) {
+                    corner = next++;
+                    evaluatePoint(net, u, v, vertices + corner * VERTEX_STRIDE);
+                }
+                edge.push_back(corner);
+            }
+        }
 
-                Point3D vertex = evaluate(u, v);
-                Point3D normal = calculateNormal(u, v);
+        if (!indexOut) return;
 
-                vertices.push_back(vertex);
-                normals.push_back(normal);
-                //   = (u,v) 
-                texCoords.push_back(u);
-                texCoords.push_back(v);
+        PatchMeshWriter writer = { vertices, baseVertex, indexOut };
+        for (int i = 1; i < nu - 1; i++) {
+            for (int j = 1; j < nv - 1; j++) {
+                writer.addTriangle(grid(i, j), grid(i + 1, j), grid(i, j + 1));
+                writer.addTriangle(grid(i, j + 1), grid(i + 1, j), grid(i + 1, j + 1));
             }
         }
 
-        // Create triangle indices for 12x12 grid
+        std::vector<int> ringV0, ringV1, ringU0, ringU1;
+        for (int i = 1; i < nu; i++) {
+            ringV0.push_back(grid(i, 1));
+            ringV1.push_back(grid(i, nv - 1));
+        }
+        for (int j = 1; j < nv; j++) {
+            ringU0.push_back(grid(1, j));
+            ringU1.push_back(grid(nu - 1, j));
+        }
+        writer.zipper(edgeVertices[EDGE_V0], ringV0, 0);
+        writer.zipper(edgeVertices[EDGE_V1], ringV1, 0);
+        writer.zipper(edgeVertices[EDGE_U0], ringU0, 1);
+        writer.zipper(edgeVertices[EDGE_U1], ringU1, 1);
+    }
+
+    // Triangle indices for one resolution x resolution grid
+    void buildUniformIndices(int baseVertex, int* out) const {
         for (int i = 0; i < resolution; i++) {
             for (int j = 0; j < resolution; j++) {
-                int topLeft = i * (resolution + 1) + j;
+                int topLeft = baseVertex + i * (resolution + 1) + j;
                 int topRight = topLeft + 1;
-                int bottomLeft = (i + 1) * (resolution + 1) + j;
+                int bottomLeft = baseVertex + (i + 1) * (resolution + 1) + j;
                 int bottomRight = bottomLeft + 1;
 
                 // First triangle
-                indices.push_back(topLeft);
-                indices.push_back(bottomLeft);
-                indices.push_back(topRight);
+                *out++ = topLeft;
+                *out++ = bottomLeft;
+                *out++ = topRight;
 
                 // Second triangle
-                indices.push_back(topRight);
-                indices.push_back(bottomLeft);
-                indices.push_back(bottomRight);
+                *out++ = topRight;
+                *out++ = bottomLeft;
+                *out++ = bottomRight;
+            }
+        }
+    }
+
+    // The same grid as one strip per row: (i, j), (i + 1, j) pairs give
+    // the triangles of buildUniformIndices() with the same winding
+    void buildUniformStrips(int baseVertex, GLuint* out) const {
+        for (int i = 0; i < resolution; i++) {
+            for (int j = 0; j <= resolution; j++) {
+                *out++ = baseVertex + i * (resolution + 1) + j;
+                *out++ = baseVertex + (i + 1) * (resolution + 1) + j;
+            }
+            *out++ = RESTART_INDEX;
+        }
+    }
+
+    int uniformStripLength() const { return resolution * (2 * (resolution + 1) + 1); }
+
+    // Sizes every patch's slice of the shared buffers (serially, so the
+    // parallel phase only writes inside its own slices), builds the basis
+    // tables the patches need, then evaluates all patches on the pool.
+    // Indices are only rebuilt when the topology changed.
+    void tessellate(bool verbose = true) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        int patchCount = getPatchCount();
+        bool rebuildIndices;
+        vertexOffsets.assign(patchCount + 1, 0);
+        indexOffsets.assign(patchCount + 1, 0);
+        if (adaptive) {
+            for (int p = 0; p < patchCount; p++) {
+                vertexOffsets[p + 1] = vertexOffsets[p] + levels[p].vertexCount();
+                indexOffsets[p + 1] = indexOffsets[p] + levels[p].indexCount();
+                basisFor(levels[p].innerU);
+                basisFor(levels[p].innerV);
+            }
+            rebuildIndices = indexResolution != ADAPTIVE_TOPOLOGY || meshLevels != levels;
+        }
+        else {
+            for (int p = 0; p < patchCount; p++) {
+                vertexOffsets[p + 1] = vertexOffsets[p] + (resolution + 1) * (resolution + 1);
+                indexOffsets[p + 1] = indexOffsets[p] + resolution * resolution * 6;
+            }
+            basisFor(resolution);
+            // Create triangle indices for 12x12 grid; the topology only
+            // depends on the resolution and the patch count
+            rebuildIndices = indexResolution != resolution || (int)indices.size() != indexOffsets[patchCount];
+        }
+        vertexData.resize(vertexOffsets[patchCount] * VERTEX_STRIDE);
+        if (rebuildIndices) {
+            indices.resize(indexOffsets[patchCount]);
+            stripIndices.resize(adaptive ? 0 : patchCount * uniformStripLength());
+            indexBufferStale = true;
+        }
+
+        // A full pass covers any pending edits
+        for (int p : dirtyPatchList) dirtyPatches[p] = 0;
+        dirtyPatchList.clear();
+        dirtyVertexRanges.clear();
+        vertexBufferStale = true;
+
+        pool.parallelFor(patchCount, [&](int begin, int end) {
+            for (int p = begin; p < end; p++) {
+                const Point3D* net = &controlPoints[p * 16];
+                float* vertices = &vertexData[vertexOffsets[p] * VERTEX_STRIDE];
+                int* indexOut = rebuildIndices ? indices.data() + indexOffsets[p] : NULL;
+                if (adaptive) {
+                    buildAdaptivePatch(net, levels[p], vertices, vertexOffsets[p], indexOut);
+                }
+                else {
+                    evaluateGrid(net, basisTables[resolution], basisTables[resolution], vertices);
+                    if (indexOut) {
+                        buildUniformIndices(vertexOffsets[p], indexOut);
+                        buildUniformStrips(vertexOffsets[p], &stripIndices[p * uniformStripLength()]);
+                    }
+                }
+            }
+        });
+
+        if (rebuildIndices) {
+            if (adaptive) {
+                meshLevels = levels;
+                indexResolution = ADAPTIVE_TOPOLOGY;
+            }
+            else {
+                indexResolution = resolution;
             }
         }
 
-        std::cout << "Bezier patch tessellated: " << vertices.size() << " vertices, "
-            << indices.size() / 3 << " triangles" << std::endl;
+        lastTessellationMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        if (verbose) {
+            std::cout << "Bezier patch tessellated: " << patchCount << " patches, " << vertexData.size() / VERTEX_STRIDE << " vertices, "
+                << indices.size() / 3 << " triangles in " << lastTessellationMs << " ms (" << simdLevelName(simdLevel) << ", "
+                << pool.getThreadCount() << " threads)" << std::endl;
+        }
+    }
+
+    // Times the forward-difference path (evaluate + calculateNormal per
+    // vertex) against evaluateGrid() on the first patch at every available
+    // SIMD level and
+    // reports how far the normals differ, separately for the interior and
+    // the u = 1 / v = 1 edges
+    void benchmark() {
+        const int resolutions[] = { 12, 32, 64, 128, 256, 512, 1024 };
+        int savedResolution = resolution;
+        SimdLevel savedLevel = simdLevel;
+        SurfaceType savedType = surfaceType;
+        surfaceType = SURFACE_BEZIER;
+
+        std::cout << "Bezier normals benchmark (legacy = forward differences, others = derivative bases)" << std::endl;
+        for (int r : resolutions) {
+            resolution = r;
+
+            auto start = std::chrono::high_resolution_clock::now();
+            std::vector<Point3D> legacyPositions, legacyNormals;
+            legacyPositions.reserve((r + 1) * (r + 1));
+            legacyNormals.reserve((r + 1) * (r + 1));
+            for (int i = 0; i <= r; i++) {
+                for (int j = 0; j <= r; j++) {
+                    float u = float(i) / r;
+                    float v = float(j) / r;
+                    legacyPositions.push_back(evaluate(u, v));
+                    legacyNormals.push_back(calculateNormal(u, v));
+                }
+            }
+            double legacyMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+            std::cout << "  " << r << "x" << r << ": legacy " << legacyMs << " ms";
+            std::vector<float> grid((r + 1) * (r + 1) * VERTEX_STRIDE);
+            const BasisTable& table = basisFor(r);
+            for (int level = SIMD_SCALAR; level <= maxSimdLevel; level++) {
+                simdLevel = SimdLevel(level);
+                auto kernelStart = std::chrono::high_resolution_clock::now();
+                evaluateGrid(&controlPoints[0], table, table, grid.data());
+                double kernelMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - kernelStart).count();
+                std::cout << ", " << simdLevelName(simdLevel) << " " << kernelMs << " ms ("
+                    << legacyMs / std::max(kernelMs, 1e-6) << "x)";
+            }
+
+            float interiorError = 0.0f, edgeError = 0.0f, positionError = 0.0f;
+            for (int i = 0; i <= r; i++) {
+                for (int j = 0; j <= r; j++) {
+                    const Point3D& p = legacyPositions[i * (r + 1) + j];
+                    const float* q = &grid[(i * (r + 1) + j) * VERTEX_STRIDE];
+                    positionError = std::max(positionError, std::max(fabsf(p.x - q[0]), std::max(fabsf(p.y - q[1]), fabsf(p.z - q[2]))));
+
+                    const Point3D& a = legacyNormals[i * (r + 1) + j];
+                    const float* b = &grid[(i * (r + 1) + j) * VERTEX_STRIDE + 3];
+                    float error = std::max(fabsf(a.x - b[0]), std::max(fabsf(a.y - b[1]), fabsf(a.z - b[2])));
+                    float& worst = (i == r || j == r) ? edgeError : interiorError;
+                    worst = std::max(worst, error);
+                }
+            }
+            std::cout << ", max position difference " << positionError << ", max normal difference " << interiorError
+                << " interior, " << edgeError << " at edges" << std::endl;
+        }
+
+        resolution = savedResolution;
+        simdLevel = savedLevel;
+        surfaceType = savedType;
+        tessellate();
+    }
+
+    // Brings the vertex buffer up to date: everything after a full
+    // tessellation, otherwise only the dirty ranges. The index buffer is
+    // re-uploaded only when the topology changed.
+    void uploadVertexBuffer() {
+        if (!vertexBuffer) glGenBuffers(1, &vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+
+        lastUploadBytes = 0;
+        GLsizeiptr size = vertexData.size() * sizeof(float);
+        if (vertexBufferStale || size != vertexBufferSize) {
+            glBufferData(GL_ARRAY_BUFFER, size, vertexData.data(), GL_DYNAMIC_DRAW);
+            vertexBufferSize = size;
+            lastUploadBytes = size;
+        }
+        else {
+            for (const std::pair<int, int>& range : dirtyVertexRanges) {
+                GLsizeiptr bytes = (range.second - range.first) * VERTEX_STRIDE * sizeof(float);
+                glBufferSubData(GL_ARRAY_BUFFER, range.first * VERTEX_STRIDE * sizeof(float), bytes,
+                    &vertexData[range.first * VERTEX_STRIDE]);
+                lastUploadBytes += bytes;
+            }
+        }
+        if (lastUploadBytes) {
+            stats.vertexUploads++;
+            stats.bytesUploaded += lastUploadBytes;
+        }
+        vertexBufferStale = false;
+        dirtyVertexRanges.clear();
+
+        // Indices only change with the topology
+        bool strips = GLEW_VERSION_3_1 && !stripIndices.empty();
+        if (!indexBuffer) glGenBuffers(1, &indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        if (indexBufferStale || strips != drawingStrips) {
+            GLsizeiptr bytes = strips ? stripIndices.size() * sizeof(GLuint) : indices.size() * sizeof(int);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, bytes, strips ? (const void*)stripIndices.data() : (const void*)indices.data(), GL_STATIC_DRAW);
+            stats.indexUploads++;
+            stats.bytesUploaded += bytes;
+            indexBufferStale = false;
+            drawingStrips = strips;
+        }
     }
 
     void render() {
         glEnable(GL_TEXTURE_2D);
         glEnable(GL_LIGHTING);
 
-        glBegin(GL_TRIANGLES);
-        for (size_t i = 0; i < indices.size(); i++) {
-            int idx = indices[i];
-            Point3D normal = normals[idx];
-            Point3D vertex = vertices[idx];
-            float u = texCoords[idx * 2];
-            float v = texCoords[idx * 2 + 1];
+        // Client arrays when buffer objects are missing
+        bool useBuffer = GLEW_VERSION_1_5 != 0;
+        if (useBuffer) uploadVertexBuffer();
+        auto attribute = [&](int offset) {
+            return useBuffer ? (const void*)(offset * sizeof(float)) : (const void*)(vertexData.data() + offset);
+        };
 
-            glNormal3f(normal.x, normal.y, normal.z);
-            glTexCoord2f(u, v);
-            glVertex3f(vertex.x, vertex.y, vertex.z);
+        GLsizei stride = VERTEX_STRIDE * sizeof(float);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(3, GL_FLOAT, stride, attribute(0));
+        glNormalPointer(GL_FLOAT, stride, attribute(3));
+        glTexCoordPointer(2, GL_FLOAT, stride, attribute(6));
+
+        if (useBuffer && drawingStrips) {
+            glEnable(GL_PRIMITIVE_RESTART);
+            glPrimitiveRestartIndex(RESTART_INDEX);
+            glDrawElements(GL_TRIANGLE_STRIP, (GLsizei)stripIndices.size(), GL_UNSIGNED_INT, 0);
+            glDisable(GL_PRIMITIVE_RESTART);
+            stats.indicesSubmitted += stripIndices.size();
+        }
+        else {
+            glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, useBuffer ? 0 : indices.data());
+            stats.indicesSubmitted += indices.size();
+        }
+        stats.listIndices += indices.size();
+        stats.immediateCalls += indices.size() * 3 + getPatchCount() * 2;
+        stats.drawCalls++;
+        stats.frames++;
+
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        if (useBuffer) {
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
         }
-        glEnd();
 
         glDisable(GL_TEXTURE_2D);
     }
 };
 
+const float BezierPatch::NORMAL_STEP = 0.01f;
+const float BezierPatch::NURBS_INNER_WEIGHT = 3.0f;
+const float BezierPatch::PATCH_KNOTS[8] = { 0, 0, 0, 0, 1, 1, 1, 1 };
+
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        std::cout << "Shader compilation failed: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Control points go through untouched; the tessellation stages do the work
+const char* patchVertexShader = R"(
+#version 400 compatibility
+void main() {
+    gl_Position = gl_Vertex;
+}
+)";
+
+// Same level choice as BezierPatch::chooseLevels, per patch on the GPU: each
+// control curve's level is the larger of Wang's flatness bound and its
+// projected length over edgePixels. Outer levels only depend on the boundary
+// curve, so patches sharing an edge agree on it.
+const char* patchControlShader = R"(
+#version 400 compatibility
+layout(vertices = 16) out;
+
+uniform vec2 viewportSize;
+uniform float edgePixels;
+uniform float flatnessPixels;
+
+vec2 screen[16];
+bool behind[16];
+
+float curveLevel(int first, int step) {
+    vec2 q0 = screen[first], q1 = screen[first + step], q2 = screen[first + 2 * step], q3 = screen[first + 3 * step];
+    if (behind[first] || behind[first + step] || behind[first + 2 * step] || behind[first + 3 * step]) {
+        return float(gl_MaxTessGenLevel);
+    }
+    float len = distance(q0, q1) + distance(q1, q2) + distance(q2, q3);
+    float secondDifference = max(length(q2 - 2.0 * q1 + q0), length(q3 - 2.0 * q2 + q1));
+    float level = max(sqrt(0.75 * secondDifference / flatnessPixels), len / edgePixels);
+    return clamp(level, 1.0, float(gl_MaxTessGenLevel));
+}
+
+void main() {
+    gl_out[gl_InvocationID].gl_Position = gl_in[gl_InvocationID].gl_Position;
+
+    if (gl_InvocationID == 0) {
+        for (int n = 0; n < 16; n++) {
+            vec4 clip = gl_ModelViewProjectionMatrix * gl_in[n].gl_Position;
+            behind[n] = clip.w <= 1e-4;
+            screen[n] = (clip.xy / max(clip.w, 1e-4) * 0.5 + 0.5) * viewportSize;
+        }
+
+        // Control point i * 4 + j: curves along u step by 4, along v by 1
+        float alongU[4], alongV[4];
+        for (int c = 0; c < 4; c++) {
+            alongU[c] = curveLevel(c, 4);
+            alongV[c] = curveLevel(c * 4, 1);
+        }
+
+        gl_TessLevelOuter[0] = alongV[0]; // u = 0
+        gl_TessLevelOuter[1] = alongU[0]; // v = 0
+        gl_TessLevelOuter[2] = alongV[3]; // u = 1
+        gl_TessLevelOuter[3] = alongU[3]; // v = 1
+        gl_TessLevelInner[0] = max(max(alongU[0], alongU[1]), max(alongU[2], alongU[3]));
+        gl_TessLevelInner[1] = max(max(alongV[0], alongV[1]), max(alongV[2], alongV[3]));
+    }
+}
+)";
+
+const char* patchEvaluationShader = R"(
+#version 400 compatibility
+layout(quads, equal_spacing, ccw) in;
+
+out vec3 eyePosition;
+out vec3 eyeNormal;
+out vec2 texCoord;
+
+// Cubic Bernstein basis and its derivative
+void bernstein(float t, out vec4 b, out vec4 d) {
+    float s = 1.0 - t;
+    b = vec4(s * s * s, 3.0 * t * s * s, 3.0 * t * t * s, t * t * t);
+    d = vec4(-3.0 * s * s, 3.0 * s * s - 6.0 * t * s, 6.0 * t * s - 3.0 * t * t, 3.0 * t * t);
+}
+
+void main() {
+    float u = gl_TessCoord.x;
+    float v = gl_TessCoord.y;
+    vec4 bu, du, bv, dv;
+    bernstein(u, bu, du);
+    bernstein(v, bv, dv);
+
+    vec3 position = vec3(0.0), alongU = vec3(0.0), alongV = vec3(0.0);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            vec3 cp = gl_in[i * 4 + j].gl_Position.xyz;
+            position += cp * (bu[i] * bv[j]);
+            alongU += cp * (du[i] * bv[j]);
+            alongV += cp * (bu[i] * dv[j]);
+        }
+    }
+
+    eyePosition = (gl_ModelViewMatrix * vec4(position, 1.0)).xyz;
+    eyeNormal = gl_NormalMatrix * cross(alongU, alongV);
+    texCoord = vec2(u, v);
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position, 1.0);
+}
+)";
+
+// Fixed-function light 0 and front material, evaluated per fragment and
+// modulated by the texture like GL_MODULATE
+const char* patchFragmentShader = R"(
+#version 400 compatibility
+in vec3 eyePosition;
+in vec3 eyeNormal;
+in vec2 texCoord;
+
+uniform sampler2D surfaceTexture;
+
+void main() {
+    vec3 n = normalize(eyeNormal);
+    vec4 lightPosition = gl_LightSource[0].position;
+    vec3 l = normalize(lightPosition.xyz - eyePosition * lightPosition.w);
+    float diffuse = max(dot(n, l), 0.0);
+
+    vec4 color = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient + gl_FrontLightProduct[0].diffuse * diffuse;
+    if (diffuse > 0.0) {
+        vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));
+        color += gl_FrontLightProduct[0].specular * pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess);
+    }
+    gl_FragColor = texture(surfaceTexture, texCoord) * clamp(color, 0.0, 1.0);
+}
+)";
+
+// GL 4 path for BezierPatch: each patch's 16 control points are drawn as
+// one GL_PATCHES primitive and the tessellation stages evaluate the surface, so
+// no vertices are generated on the CPU. The triangle budget of the CPU
+// adaptive path does not apply here.
+class HardwareBezierRenderer {
+private:
+    GLuint program;
+    GLuint controlPointBuffer;
+    GLuint primitivesQuery;
+    GLint viewportSizeLocation;
+    GLint edgePixelsLocation;
+    GLint flatnessPixelsLocation;
+    GLint textureLocation;
+    int uploadedVersion;
+    int uploadedPatches;
+    bool available;
+    bool queryPending;
+    int triangles;
+
+public:
+    HardwareBezierRenderer() : program(0), controlPointBuffer(0), primitivesQuery(0),
+        viewportSizeLocation(-1), edgePixelsLocation(-1), flatnessPixelsLocation(-1), textureLocation(-1),
+        uploadedVersion(-1), uploadedPatches(0), available(false), queryPending(false), triangles(0) {}
+
+    bool initialize() {
+        if (!GLEW_VERSION_4_0 && !GLEW_ARB_tessellation_shader) {
+            std::cout << "Tessellation shaders not supported, using CPU tessellation" << std::endl;
+            return false;
+        }
+
+        const GLenum types[] = { GL_VERTEX_SHADER, GL_TESS_CONTROL_SHADER, GL_TESS_EVALUATION_SHADER, GL_FRAGMENT_SHADER };
+        const char* sources[] = { patchVertexShader, patchControlShader, patchEvaluationShader, patchFragmentShader };
+        GLuint shaders[4];
+        bool compiled = true;
+        for (int i = 0; i < 4; i++) {
+            shaders[i] = compileShader(types[i], sources[i]);
+            compiled = compiled && shaders[i] != 0;
+        }
+
+        if (compiled) {
+            program = glCreateProgram();
+            for (int i = 0; i < 4; i++) glAttachShader(program, shaders[i]);
+            glLinkProgram(program);
+        }
+        for (int i = 0; i < 4; i++) {
+            if (shaders[i]) glDeleteShader(shaders[i]);
+        }
+
+        GLint linked = GL_FALSE;
+        if (program) glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            if (program) {
+                char log[1024];
+                glGetProgramInfoLog(program, sizeof(log), NULL, log);
+                std::cout << "Program link failed: " << log << std::endl;
+                glDeleteProgram(program);
+                program = 0;
+            }
+            std::cout << "Tessellation shaders unavailable, using CPU tessellation" << std::endl;
+            return false;
+        }
+
+        viewportSizeLocation = glGetUniformLocation(program, "viewportSize");
+        edgePixelsLocation = glGetUniformLocation(program, "edgePixels");
+        flatnessPixelsLocation = glGetUniformLocation(program, "flatnessPixels");
+        textureLocation = glGetUniformLocation(program, "surfaceTexture");
+
+        glGenBuffers(1, &controlPointBuffer);
+
+        glGenQueries(1, &primitivesQuery);
+
+        available = true;
+        return true;
+    }
+
+    bool isAvailable() const { return available; }
+
+    // Triangles generated by the last finished draw (read back without
+    // stalling, so it lags a frame or two)
+    int getTriangleCount() const { return triangles; }
+
+    void render(const BezierPatch& patch, const int viewport[4]) {
+        glBindBuffer(GL_ARRAY_BUFFER, controlPointBuffer);
+        if (uploadedVersion != patch.getControlPointsVersion()) {
+            GLsizeiptr size = patch.getPatchCount() * 16 * sizeof(Point3D);
+            if (uploadedPatches != patch.getPatchCount()) {
+                glBufferData(GL_ARRAY_BUFFER, size, patch.getControlPoints().data(), GL_DYNAMIC_DRAW);
+                uploadedPatches = patch.getPatchCount();
+            }
+            else {
+                glBufferSubData(GL_ARRAY_BUFFER, 0, size, patch.getControlPoints().data());
+            }
+            uploadedVersion = patch.getControlPointsVersion();
+        }
+
+        if (queryPending) {
+            GLuint ready = 0;
+            glGetQueryObjectuiv(primitivesQuery, GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (ready) {
+                GLuint generated = 0;
+                glGetQueryObjectuiv(primitivesQuery, GL_QUERY_RESULT, &generated);
+                triangles = (int)generated;
+                queryPending = false;
+            }
+        }
+
+        glUseProgram(program);
+        glUniform2f(viewportSizeLocation, (float)viewport[2], (float)viewport[3]);
+        glUniform1f(edgePixelsLocation, patch.getEdgePixels());
+        glUniform1f(flatnessPixelsLocation, patch.getFlatnessPixels());
+        glUniform1i(textureLocation, 0);
+
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(Point3D), (const void*)0);
+        glPatchParameteri(GL_PATCH_VERTICES, 16);
+
+        bool measure = !queryPending;
+        if (measure) glBeginQuery(GL_PRIMITIVES_GENERATED, primitivesQuery);
+        glDrawArrays(GL_PATCHES, 0, uploadedPatches * 16);
+        if (measure) {
+            glEndQuery(GL_PRIMITIVES_GENERATED);
+            queryPending = true;
+        }
+
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glUseProgram(0);
+    }
+
+    void cleanup() {
+        if (program) glDeleteProgram(program);
+        if (controlPointBuffer) glDeleteBuffers(1, &controlPointBuffer);
+        if (primitivesQuery) glDeleteQueries(1, &primitivesQuery);
+        program = controlPointBuffer = primitivesQuery = 0;
+        available = false;
+    }
+};
+
 class Camera {
 private:
     float cameraDistance;
@@ -277,6 +2681,32 @@ public:
 BezierPatch patch;
 Camera camera;
 Texture2D texture;
+HardwareBezierRenderer hardwareRenderer;
+bool useHardwareTessellation = false;
+int reportedHardwareTriangles = -1;
+
+// Keyboard control-point editing: the selected point (with its welded
+// copies) is drawn as a marker and moved along y
+int selectedControlPoint = -1;
+const float CONTROL_POINT_STEP = 0.1f;
+
+// Click-to-edit: a left click picks the surface, and while the button is
+// held the nearest control point follows the mouse in the plane through it
+// facing the camera
+bool draggingControlPoint = false;
+Point3D dragPlaneNormal;
+float dragPlaneDistance = 0.0f;
+Point3D dragOffset;
+
+const char* WINDOW_TITLE = "Assignment 4 - Part 3.1: 2D Texture Mapping on Bezier Patch";
+
+// Control-point animation: the patch is re-tessellated every frame and the
+// average tessellation time is shown in the window title once per second
+bool animating = false;
+int animationStartMs = 0;
+int animationStatsStartMs = 0;
+double animationTessellationMs = 0.0;
+int animationFrames = 0;
 
 void setupLighting() {
     glEnable(GL_LIGHTING);
@@ -311,18 +2741,180 @@ void display() {
     camera.apply();
     setupLighting();
 
+    int viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    // The tessellation shaders only evaluate Bezier patches
+    bool hardware = useHardwareTessellation && hardwareRenderer.isAvailable() && patch.getSurfaceType() == BezierPatch::SURFACE_BEZIER;
+    patch.updateDirtyPatches();
+    if (patch.isAdaptive() && !hardware) {
+        float modelview[16], projection[16];
+        glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+        glGetFloatv(GL_PROJECTION_MATRIX, projection);
+        patch.updateAdaptive(modelview, projection, viewport);
+    }
+
     // Bind and enable texture
     texture.bind();
     glEnable(GL_TEXTURE_2D);
 
     // Draw the textured Bezier patch
-    patch.render();
+    if (hardware) {
+        hardwareRenderer.render(patch, viewport);
+        if (hardwareRenderer.getTriangleCount() && hardwareRenderer.getTriangleCount() != reportedHardwareTriangles) {
+            reportedHardwareTriangles = hardwareRenderer.getTriangleCount();
+            std::cout << "Hardware tessellation: " << reportedHardwareTriangles << " triangles" << std::endl;
+        }
+    }
+    else {
+        patch.render();
+    }
 
     glDisable(GL_TEXTURE_2D);
 
+    if (selectedControlPoint >= 0) {
+        const Point3D& p = patch.getControlPoint(selectedControlPoint);
+        glDisable(GL_LIGHTING);
+        glDisable(GL_DEPTH_TEST);
+        glPointSize(8.0f);
+        glColor3f(1.0f, 1.0f, 0.0f);
+        glBegin(GL_POINTS);
+        glVertex3f(p.x, p.y, p.z);
+        glEnd();
+        glEnable(GL_DEPTH_TEST);
+    }
+
     glutSwapBuffers();
 }
 
+// Steps the selection to the next (or previous) distinct control point
+void selectControlPoint(int direction) {
+    int count = patch.getPatchCount() * 16;
+    int index = selectedControlPoint;
+    for (int n = 0; n < count; n++) {
+        index = index < 0 ? (direction > 0 ? 0 : count - 1) : (index + direction + count) % count;
+        if (patch.weldLeader(index) == index) break;
+    }
+    selectedControlPoint = index;
+    const Point3D& p = patch.getControlPoint(index);
+    std::cout << "Control point " << index << " (patch " << index / 16 << "): " << p.x << ", " << p.y << ", " << p.z << std::endl;
+}
+
+void moveSelectedControlPoint(float dy) {
+    if (selectedControlPoint < 0) return;
+    Point3D p = patch.getControlPoint(selectedControlPoint);
+    p.y += dy;
+    patch.moveControlPoint(selectedControlPoint, p);
+    patch.updateDirtyPatches();
+    std::cout << "Control point " << selectedControlPoint << " moved: " << patch.getLastUpdatePatches() << " of "
+        << patch.getPatchCount() << " patches re-evaluated in " << patch.getLastUpdateMs() << " ms, "
+        << patch.getPendingUploadBytes() / 1024 << " KB to upload" << std::endl;
+}
+
+// Ray through a window pixel (GLUT coordinates, y down) for the current camera
+Ray rayFromWindow(int x, int y) {
+    camera.apply();
+    GLdouble modelview[16], projection[16];
+    GLint viewport[4];
+    glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    double windowX = x + 0.5, windowY = viewport[3] - y - 0.5;
+    GLdouble nearX, nearY, nearZ, farX, farY, farZ;
+    gluUnProject(windowX, windowY, 0.0, modelview, projection, viewport, &nearX, &nearY, &nearZ);
+    gluUnProject(windowX, windowY, 1.0, modelview, projection, viewport, &farX, &farY, &farZ);
+
+    Point3D d(float(farX - nearX), float(farY - nearY), float(farZ - nearZ));
+    float length = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    return Ray(Point3D(float(nearX), float(nearY), float(nearZ)), Point3D(d.x / length, d.y / length, d.z / length));
+}
+
+// Where the ray meets the drag plane; false when it runs parallel to it
+bool dragPlaneHit(const Ray& ray, Point3D& point) {
+    const Point3D& n = dragPlaneNormal;
+    float denominator = n.x * ray.direction.x + n.y * ray.direction.y + n.z * ray.direction.z;
+    if (fabsf(denominator) < 1e-6f) return false;
+    float t = (dragPlaneDistance - (n.x * ray.origin.x + n.y * ray.origin.y + n.z * ray.origin.z)) / denominator;
+    point = Point3D(ray.origin.x + ray.direction.x * t, ray.origin.y + ray.direction.y * t, ray.origin.z + ray.direction.z * t);
+    return true;
+}
+
+void mouse(int button, int state, int x, int y) {
+    if (button != GLUT_LEFT_BUTTON) return;
+    if (state == GLUT_UP) {
+        if (draggingControlPoint) {
+            const Point3D& p = patch.getControlPoint(selectedControlPoint);
+            std::cout << "Control point " << selectedControlPoint << " moved to " << p.x << ", " << p.y << ", " << p.z << std::endl;
+        }
+        draggingControlPoint = false;
+        return;
+    }
+
+    Ray ray = rayFromWindow(x, y);
+    BezierPatch::PatchHit hit;
+    if (!patch.intersect(ray, hit)) {
+        std::cout << "No surface under the cursor (" << patch.getLastPickUs() << " us)" << std::endl;
+        return;
+    }
+
+    selectedControlPoint = patch.nearestControlPoint(hit);
+    const Point3D& cp = patch.getControlPoint(selectedControlPoint);
+    dragPlaneNormal = ray.direction;
+    dragPlaneDistance = cp.x * ray.direction.x + cp.y * ray.direction.y + cp.z * ray.direction.z;
+    Point3D grab;
+    dragOffset = Point3D(0, 0, 0);
+    if (dragPlaneHit(ray, grab)) dragOffset = Point3D(cp.x - grab.x, cp.y - grab.y, cp.z - grab.z);
+    draggingControlPoint = true;
+
+    std::cout << "Picked patch " << hit.patch << " at (u, v) = (" << hit.u << ", " << hit.v << "), point "
+        << hit.point.x << ", " << hit.point.y << ", " << hit.point.z << " in " << patch.getLastPickUs() << " us (pick structure "
+        << patch.getLastPickBuildMs() << " ms); dragging control point " << selectedControlPoint << std::endl;
+    glutPostRedisplay();
+}
+
+void motion(int x, int y) {
+    if (!draggingControlPoint) return;
+    Point3D p;
+    if (!dragPlaneHit(rayFromWindow(x, y), p)) return;
+    patch.moveControlPoint(selectedControlPoint, Point3D(p.x + dragOffset.x, p.y + dragOffset.y, p.z + dragOffset.z));
+    glutPostRedisplay();
+}
+
+void idle() {
+    int now = glutGet(GLUT_ELAPSED_TIME);
+    patch.animate((now - animationStartMs) / 1000.0f);
+
+    animationTessellationMs += patch.getLastTessellationMs();
+    animationFrames++;
+    if (now - animationStatsStartMs >= 1000) {
+        std::ostringstream title;
+        title << WINDOW_TITLE << " | " << patch.getResolution() << "x" << patch.getResolution() << ", "
+            << BezierPatch::simdLevelName(patch.getSimdLevel()) << ", tessellation "
+            << animationTessellationMs / animationFrames << " ms";
+        glutSetWindowTitle(title.str().c_str());
+        animationStatsStartMs = now;
+        animationTessellationMs = 0.0;
+        animationFrames = 0;
+    }
+
+    glutPostRedisplay();
+}
+
+void toggleAnimation() {
+    animating = !animating;
+    if (animating) {
+        animationStartMs = animationStatsStartMs = glutGet(GLUT_ELAPSED_TIME);
+        animationTessellationMs = 0.0;
+        animationFrames = 0;
+        glutIdleFunc(idle);
+    }
+    else {
+        glutIdleFunc(NULL);
+        patch.resetAnimation();
+        glutSetWindowTitle(WINDOW_TITLE);
+    }
+}
+
 void reshape(int w, int h) {
     glViewport(0, 0, w, h);
 }
@@ -331,6 +2923,54 @@ void keyboard(unsigned char key, int x, int y) {
     switch (key) {
     case 27: exit(0); break; // ESC
     case 'r': case 'R': camera.reset(); break;
+    case '+': case '=':
+        if (patch.isAdaptive() || useHardwareTessellation) patch.setEdgePixels(patch.getEdgePixels() / 2);
+        else patch.setResolution(std::min(patch.getResolution() * 2, 1024));
+        break;
+    case '-': case '_':
+        if (patch.isAdaptive() || useHardwareTessellation) patch.setEdgePixels(patch.getEdgePixels() * 2);
+        else patch.setResolution(std::max(patch.getResolution() / 2, 3));
+        break;
+    case 'a': case 'A':
+        patch.setAdaptive(!patch.isAdaptive());
+        std::cout << "Adaptive tessellation " << (patch.isAdaptive() ? "on" : "off") << std::endl;
+        break;
+    case 't': case 'T': {
+        // 1, 2, 4, ... up to one thread per hardware thread, then back to 1
+        int hardwareThreads = std::max(1, (int)std::thread::hardware_concurrency());
+        int threads = patch.getThreadCount() >= hardwareThreads ? 1 : std::min(patch.getThreadCount() * 2, hardwareThreads);
+        patch.setThreadCount(threads);
+        patch.tessellate();
+        break;
+    }
+    case 'c': selectControlPoint(1); break;
+    case 'C': selectControlPoint(-1); break;
+    case 'u': case 'U': moveSelectedControlPoint(CONTROL_POINT_STEP); break;
+    case 'j': case 'J': moveSelectedControlPoint(-CONTROL_POINT_STEP); break;
+    case 'h': case 'H':
+        if (!hardwareRenderer.isAvailable()) {
+            std::cout << "Tessellation shaders unavailable, staying on CPU tessellation" << std::endl;
+            break;
+        }
+        useHardwareTessellation = !useHardwareTessellation;
+        reportedHardwareTriangles = -1;
+        std::cout << (useHardwareTessellation ? "GPU" : "CPU") << " tessellation" << std::endl;
+        break;
+    case '[': patch.setTriangleBudget(patch.getTriangleBudget() / 2); std::cout << "Triangle budget " << patch.getTriangleBudget() << std::endl; break;
+    case ']': patch.setTriangleBudget(patch.getTriangleBudget() * 2); std::cout << "Triangle budget " << patch.getTriangleBudget() << std::endl; break;
+    case 'b': case 'B': patch.benchmark(); break;
+    case 's': case 'S': patch.printRenderStats(); break;
+    case 'g': case 'G': texture.benchmark(patch.getThreadPool()); break;
+    case 'p': case 'P': toggleAnimation(); break;
+    case 'n': case 'N':
+        patch.setSurfaceType(BezierPatch::SurfaceType((patch.getSurfaceType() + 1) % BezierPatch::SURFACE_TYPE_COUNT));
+        std::cout << "Surface type: " << BezierPatch::surfaceTypeName(patch.getSurfaceType()) << std::endl;
+        break;
+    case 'k': case 'K':
+        patch.setSimdLevel(patch.getSimdLevel() == patch.getMaxSimdLevel() ? BezierPatch::SIMD_SCALAR
+            : BezierPatch::SimdLevel(patch.getSimdLevel() + 1));
+        std::cout << "Tessellation kernel: " << BezierPatch::simdLevelName(patch.getSimdLevel()) << std::endl;
+        break;
     }
     glutPostRedisplay();
 }
@@ -354,12 +2994,19 @@ void init() {
     glEnable(GL_NORMALIZE);
 
     // Create procedural texture
-    if (!texture.createProcedural(512, 512)) {
+    if (!texture.createProcedural(512, 512, patch.getThreadPool())) {
         std::cout << "Failed to create texture!" << std::endl;
     }
 
+    hardwareRenderer.initialize();
+
     std::cout << "Part 3.1: 2D Texture Mapping on Bezier Patch" << std::endl;
-    std::cout << "Controls: Arrow keys to rotate, Page Up/Down to zoom, R to reset" << std::endl;
+    std::cout << "Controls: Arrow keys to rotate, Page Up/Down to zoom, R to reset, +/- to change resolution (edge length when adaptive or on the GPU), B to benchmark normals, P to animate control points, K to switch tessellation kernel" << std::endl;
+    std::cout << "          A to toggle screen-space adaptive tessellation, [/] to halve/double its triangle budget, H for GPU tessellation shaders, T to change the thread count" << std::endl;
+    std::cout << "          G to benchmark procedural texture generation" << std::endl;
+    std::cout << "          S to print render stats, N to switch between Bezier, B-spline and NURBS patches" << std::endl;
+    std::cout << "          C/Shift+C to select a control point, U/J to move it up/down" << std::endl;
+    std::cout << "          Left-drag on the surface to move the nearest control point" << std::endl;
     std::cout << "Texture coordinates: (u,v) parameters used for texture mapping" << std::endl;
 }
 
@@ -367,7 +3014,13 @@ int main(int argc, char** argv) {
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);
-    glutCreateWindow("Assignment 4 - Part 3.1: 2D Texture Mapping on Bezier Patch");
+
+    // Optional multi-patch model in BPT format, e.g. the Utah teapot
+    if (argc > 1 && !patch.loadFromFile(argv[1])) {
+        std::cout << "Using the built-in patch" << std::endl;
+    }
+
+    glutCreateWindow(WINDOW_TITLE);
 
     GLenum err = glewInit();
     if (err != GLEW_OK) {
@@ -381,6 +3034,8 @@ int main(int argc, char** argv) {
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(specialKeys);
+    glutMouseFunc(mouse);
+    glutMotionFunc(motion);
 
     glutMainLoop();
     return 0;
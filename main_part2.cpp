@@ -7,6 +7,13 @@
 #include <sstream>
 #include <cstdlib>
 #include <ctime>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 struct Vertex {
     float x, y, z;
@@ -18,20 +25,242 @@ struct Color {
     Color(float r = 1.0f, float g = 1.0f, float b = 1.0f) : r(r), g(g), b(b) {}
 };
 
-class MeshObject {
+// Column-major 4x4 matrix, laid out the way glLoadMatrixf expects
+struct Matrix4 {
+    float m[16];
+
+    Matrix4() {
+        for (int i = 0; i < 16; i++) m[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    }
+
+    static Matrix4 perspective(float fovyDegrees, float aspect, float zNear, float zFar) {
+        Matrix4 result;
+        float f = 1.0f / tanf(fovyDegrees * 3.14159265f / 360.0f);
+        result.m[0] = f / aspect;
+        result.m[5] = f;
+        result.m[10] = (zFar + zNear) / (zNear - zFar);
+        result.m[11] = -1.0f;
+        result.m[14] = 2.0f * zFar * zNear / (zNear - zFar);
+        result.m[15] = 0.0f;
+        return result;
+    }
+
+    static Matrix4 lookAt(const Vertex& eye, const Vertex& center, const Vertex& up) {
+        Vertex f(center.x - eye.x, center.y - eye.y, center.z - eye.z);
+        float fl = sqrtf(f.x * f.x + f.y * f.y + f.z * f.z);
+        f = Vertex(f.x / fl, f.y / fl, f.z / fl);
+
+        Vertex s(f.y * up.z - f.z * up.y, f.z * up.x - f.x * up.z, f.x * up.y - f.y * up.x);
+        float sl = sqrtf(s.x * s.x + s.y * s.y + s.z * s.z);
+        s = Vertex(s.x / sl, s.y / sl, s.z / sl);
+
+        Vertex u(s.y * f.z - s.z * f.y, s.z * f.x - s.x * f.z, s.x * f.y - s.y * f.x);
+
+        Matrix4 result;
+        result.m[0] = s.x; result.m[4] = s.y; result.m[8] = s.z;
+        result.m[1] = u.x; result.m[5] = u.y; result.m[9] = u.z;
+        result.m[2] = -f.x; result.m[6] = -f.y; result.m[10] = -f.z;
+        result.m[12] = -(s.x * eye.x + s.y * eye.y + s.z * eye.z);
+        result.m[13] = -(u.x * eye.x + u.y * eye.y + u.z * eye.z);
+        result.m[14] = f.x * eye.x + f.y * eye.y + f.z * eye.z;
+        return result;
+    }
+
+    // Equivalent of gluPickMatrix: maps a width x height window region
+    // centered at (x, y) onto the whole viewport
+    static Matrix4 pickMatrix(float x, float y, float width, float height, const int viewport[4]) {
+        Matrix4 result;
+        result.m[0] = viewport[2] / width;
+        result.m[5] = viewport[3] / height;
+        result.m[12] = (viewport[2] - 2.0f * (x - viewport[0])) / width;
+        result.m[13] = (viewport[3] - 2.0f * (y - viewport[1])) / height;
+        return result;
+    }
+
+    // General inverse by cofactors; returns identity for a singular matrix
+    Matrix4 inverse() const {
+        float inv[16];
+        inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+        inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+        inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+        inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+        inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+        inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+        inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+        inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+        inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+        inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+        inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+        inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+        inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+        inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+        inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+        inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+        Matrix4 result;
+        float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+        if (det == 0.0f) return result;
+
+        for (int i = 0; i < 16; i++) result.m[i] = inv[i] / det;
+        return result;
+    }
+
+    Vertex transformPoint(const Vertex& p) const {
+        float x = m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12];
+        float y = m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13];
+        float z = m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14];
+        float w = m[3] * p.x + m[7] * p.y + m[11] * p.z + m[15];
+        return Vertex(x / w, y / w, z / w);
+    }
+
+    Matrix4 operator*(const Matrix4& other) const {
+        Matrix4 result;
+        for (int col = 0; col < 4; col++) {
+            for (int row = 0; row < 4; row++) {
+                float sum = 0.0f;
+                for (int k = 0; k < 4; k++) {
+                    sum += m[k * 4 + row] * other.m[col * 4 + k];
+                }
+                result.m[col * 4 + row] = sum;
+            }
+        }
+        return result;
+    }
+};
+
+struct AABB {
+    Vertex min, max;
+
+    AABB() {}
+    AABB(const Vertex& min, const Vertex& max) : min(min), max(max) {}
+
+    bool contains(const AABB& other) const {
+        return min.x <= other.min.x && min.y <= other.min.y && min.z <= other.min.z
+            && max.x >= other.max.x && max.y >= other.max.y && max.z >= other.max.z;
+    }
+
+    float surfaceArea() const {
+        float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    static AABB merge(const AABB& a, const AABB& b) {
+        return AABB(Vertex(std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z)),
+            Vertex(std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z)));
+    }
+};
+
+struct Ray {
+    Vertex origin;
+    Vertex direction;  // normalized
+    Vertex inverseDirection;
+
+    Ray() {}
+    Ray(const Vertex& origin, const Vertex& direction)
+        : origin(origin), direction(direction),
+        inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z) {}
+
+    // Ray through the center of a window pixel (GLUT coordinates, y down),
+    // obtained by unprojecting it at the near and far planes
+    static Ray fromWindow(int mouseX, int mouseY, int windowWidth, int windowHeight,
+        const Matrix4& projection, const Matrix4& view) {
+        float ndcX = 2.0f * (mouseX + 0.5f) / windowWidth - 1.0f;
+        float ndcY = 1.0f - 2.0f * (mouseY + 0.5f) / windowHeight;
+
+        Matrix4 inverseViewProjection = (projection * view).inverse();
+        Vertex nearPoint = inverseViewProjection.transformPoint(Vertex(ndcX, ndcY, -1.0f));
+        Vertex farPoint = inverseViewProjection.transformPoint(Vertex(ndcX, ndcY, 1.0f));
+
+        Vertex d(farPoint.x - nearPoint.x, farPoint.y - nearPoint.y, farPoint.z - nearPoint.z);
+        float length = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+        return Ray(nearPoint, Vertex(d.x / length, d.y / length, d.z / length));
+    }
+
+    Vertex at(float t) const {
+        return Vertex(origin.x + direction.x * t, origin.y + direction.y * t, origin.z + direction.z * t);
+    }
+
+    // Slab test; on a hit, tEntry is the distance where the ray enters the box
+    bool intersects(const AABB& box, float tMax, float& tEntry) const {
+        float t1 = (box.min.x - origin.x) * inverseDirection.x;
+        float t2 = (box.max.x - origin.x) * inverseDirection.x;
+        float tNear = std::min(t1, t2), tFar = std::max(t1, t2);
+
+        t1 = (box.min.y - origin.y) * inverseDirection.y;
+        t2 = (box.max.y - origin.y) * inverseDirection.y;
+        tNear = std::max(tNear, std::min(t1, t2));
+        tFar = std::min(tFar, std::max(t1, t2));
+
+        t1 = (box.min.z - origin.z) * inverseDirection.z;
+        t2 = (box.max.z - origin.z) * inverseDirection.z;
+        tNear = std::max(tNear, std::min(t1, t2));
+        tFar = std::min(tFar, std::max(t1, t2));
+
+        tEntry = std::max(tNear, 0.0f);
+        return tFar >= tEntry && tEntry <= tMax;
+    }
+};
+
+// Six clip planes (ax + by + cz + d >= 0 inside) pulled out of a view-projection matrix
+class Frustum {
+public:
+    enum Containment { OUTSIDE, INTERSECTS, INSIDE };
+
+private:
+    float planes[6][4];
+
+public:
+    explicit Frustum(const Matrix4& viewProjection) {
+        const float* m = viewProjection.m;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                planes[i * 2][j] = m[j * 4 + 3] + m[j * 4 + i];
+                planes[i * 2 + 1][j] = m[j * 4 + 3] - m[j * 4 + i];
+            }
+        }
+        for (int i = 0; i < 6; i++) {
+            float length = sqrtf(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+            for (int j = 0; j < 4; j++) planes[i][j] /= length;
+        }
+    }
+
+    Containment classify(const AABB& box) const {
+        Containment result = INSIDE;
+        for (int i = 0; i < 6; i++) {
+            const float* p = planes[i];
+            // Corner furthest along the plane normal, and the one opposite it
+            float px = p[0] >= 0 ? box.max.x : box.min.x;
+            float py = p[1] >= 0 ? box.max.y : box.min.y;
+            float pz = p[2] >= 0 ? box.max.z : box.min.z;
+            if (p[0] * px + p[1] * py + p[2] * pz + p[3] < 0) return OUTSIDE;
+
+            float nx = p[0] >= 0 ? box.min.x : box.max.x;
+            float ny = p[1] >= 0 ? box.min.y : box.max.y;
+            float nz = p[2] >= 0 ? box.min.z : box.max.z;
+            if (p[0] * nx + p[1] * ny + p[2] * nz + p[3] < 0) result = INTERSECTS;
+        }
+        return result;
+    }
+};
+
+struct CullingStats {
+    int tested;
+    int visible;
+    double timeMs;
+
+    CullingStats() : tested(0), visible(0), timeMs(0.0) {}
+};
+
+// Unit cube shared by every scene object; position and scale are applied as
+// a transform at draw time instead of being baked into per-object vertices.
+class CubeMesh {
 private:
     std::vector<Vertex> vertices;
     std::vector<Vertex> normals;
     std::vector<int> indices;
-    Color diffuseColor;
-    int objectId;
-    Vertex position;
-    float scale;
 
 public:
-    MeshObject(const Vertex& pos, const Color& color, int id, float scale = 1.0f)
-        : position(pos), diffuseColor(color), objectId(id), scale(scale) {
-        std::cout << "Creating object " << id << " with color R=" << color.r << " G=" << color.g << " B=" << color.b << std::endl;
+    CubeMesh() {
         generateGeometry();
     }
 
@@ -40,7 +269,7 @@ public:
         normals.clear();
         indices.clear();
 
-        float s = scale;
+        float s = 1.0f;
         vertices = {
             Vertex(-s, -s, -s), Vertex(s, -s, -s), Vertex(s, s, -s), Vertex(-s, s, -s),
             Vertex(-s, -s, s), Vertex(s, -s, s), Vertex(s, s, s), Vertex(-s, s, s)
@@ -62,214 +291,2781 @@ public:
         };
     }
 
-    void render(bool pickingMode = false) {
-        glPushMatrix();
-        glTranslatef(position.x, position.y, position.z);
+    int getTriangleCount() const {
+        return static_cast<int>(indices.size() / 3);
+    }
+
+    // Corners of a triangle in the order draw() submits them, which is the
+    // order gl_PrimitiveID counts them in
+    void getTriangle(int triangle, Vertex& a, Vertex& b, Vertex& c) const {
+        a = vertices[indices[triangle * 3] % 8];
+        b = vertices[indices[triangle * 3 + 1] % 8];
+        c = vertices[indices[triangle * 3 + 2] % 8];
+    }
+
+    void draw(bool pickingMode) const {
+        glBegin(GL_TRIANGLES);
+        for (size_t i = 0; i < indices.size(); i++) {
+            int vertexIndex = indices[i] % 8;
+            int normalIndex = indices[i] / 8 * 4 + (i % 6) / 3;
+
+            if (!pickingMode) {
+                glNormal3f(normals[normalIndex].x, normals[normalIndex].y, normals[normalIndex].z);
+            }
+            glVertex3f(vertices[vertexIndex].x, vertices[vertexIndex].y, vertices[vertexIndex].z);
+        }
+        glEnd();
+    }
+};
+
+// Stable reference to a scene object. The generation is bumped whenever a slot
+// is recycled, so a handle to a destroyed object never aliases its successor.
+struct ObjectHandle {
+    uint32_t slot;
+    uint32_t generation;
+
+    ObjectHandle(uint32_t slot = 0xFFFFFFFFu, uint32_t generation = 0) : slot(slot), generation(generation) {}
+
+    bool operator==(const ObjectHandle& other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+};
+
+// Object ID -> slot lookup. Open addressing with linear probing keeps the table
+// in one flat allocation, so inserts and erases never touch the heap once it
+// has grown to the working-set size.
+class IdIndexMap {
+private:
+    std::vector<int> keys;
+    std::vector<uint32_t> values;
+    std::vector<unsigned char> used;
+    size_t count;
+
+    static size_t hash(int key) {
+        uint32_t h = static_cast<uint32_t>(key) * 0x9E3779B1u;
+        return h ^ (h >> 16);
+    }
+
+    void grow() {
+        std::vector<int> oldKeys;
+        std::vector<uint32_t> oldValues;
+        std::vector<unsigned char> oldUsed;
+        oldKeys.swap(keys);
+        oldValues.swap(values);
+        oldUsed.swap(used);
+
+        size_t capacity = oldKeys.empty() ? 64 : oldKeys.size() * 2;
+        keys.assign(capacity, 0);
+        values.assign(capacity, 0);
+        used.assign(capacity, 0);
+        count = 0;
+
+        for (size_t i = 0; i < oldKeys.size(); i++) {
+            if (oldUsed[i]) insert(oldKeys[i], oldValues[i]);
+        }
+    }
+
+public:
+    IdIndexMap() : count(0) {}
+
+    void insert(int key, uint32_t value) {
+        if ((count + 1) * 4 > keys.size() * 3) grow();
+
+        size_t mask = keys.size() - 1;
+        size_t i = hash(key) & mask;
+        while (used[i] && keys[i] != key) i = (i + 1) & mask;
+
+        if (!used[i]) count++;
+        keys[i] = key;
+        values[i] = value;
+        used[i] = 1;
+    }
+
+    bool find(int key, uint32_t& value) const {
+        if (keys.empty()) return false;
+
+        size_t mask = keys.size() - 1;
+        size_t i = hash(key) & mask;
+        while (used[i]) {
+            if (keys[i] == key) {
+                value = values[i];
+                return true;
+            }
+            i = (i + 1) & mask;
+        }
+        return false;
+    }
+
+    void erase(int key) {
+        if (keys.empty()) return;
+
+        size_t mask = keys.size() - 1;
+        size_t i = hash(key) & mask;
+        while (used[i] && keys[i] != key) i = (i + 1) & mask;
+        if (!used[i]) return;
+
+        // Backward-shift deletion keeps probe chains intact without tombstones
+        used[i] = 0;
+        count--;
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!used[j]) break;
+
+            size_t home = hash(keys[j]) & mask;
+            bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) {
+                keys[i] = keys[j];
+                values[i] = values[j];
+                used[i] = 1;
+                used[j] = 0;
+                i = j;
+            }
+        }
+    }
+
+    void clear() {
+        std::fill(used.begin(), used.end(), 0);
+        count = 0;
+    }
+};
+
+// Dynamic AABB tree over object bounds. Leaves store fattened boxes so small
+// moves refit in place; inserts pick the sibling with the cheapest surface
+// area increase and rotations keep the tree height balanced.
+class DynamicAabbTree {
+private:
+    struct Node {
+        AABB box;
+        uint32_t userData;
+        int parent;  // next free node while on the free list
+        int child1, child2;
+        int height;  // -1 while on the free list
+
+        bool isLeaf() const { return child1 == -1; }
+    };
+
+    // Traversal stack: 128 entries inline, which balanced trees never
+    // exceed, moving to the heap if a tree ever grows deeper
+    class NodeStack {
+    private:
+        int inlineNodes[128];
+        std::vector<int> heapNodes;
+        int* data;
+        int capacity;
+        int count;
+
+    public:
+        NodeStack() : data(inlineNodes), capacity(128), count(0) {}
+        NodeStack(const NodeStack&) = delete;
+        NodeStack& operator=(const NodeStack&) = delete;
+
+        void push(int node) {
+            if (count == capacity) {
+                if (data == inlineNodes) heapNodes.assign(inlineNodes, inlineNodes + count);
+                capacity *= 2;
+                heapNodes.resize(capacity);
+                data = heapNodes.data();
+            }
+            data[count++] = node;
+        }
+
+        int pop() { return data[--count]; }
+        bool empty() const { return count == 0; }
+    };
+
+    std::vector<Node> nodes;
+    int root;
+    int freeList;
+    float margin;
+
+    int allocateNode() {
+        if (freeList == -1) {
+            nodes.push_back(Node());
+            freeList = static_cast<int>(nodes.size()) - 1;
+            nodes[freeList].parent = -1;
+        }
+
+        int id = freeList;
+        freeList = nodes[id].parent;
+        nodes[id].parent = -1;
+        nodes[id].child1 = -1;
+        nodes[id].child2 = -1;
+        nodes[id].height = 0;
+        nodes[id].userData = 0;
+        return id;
+    }
+
+    void freeNode(int id) {
+        nodes[id].parent = freeList;
+        nodes[id].height = -1;
+        freeList = id;
+    }
+
+    void insertLeaf(int leaf) {
+        if (root == -1) {
+            root = leaf;
+            nodes[root].parent = -1;
+            return;
+        }
+
+        // Descend towards the sibling that minimizes the added surface area
+        AABB leafBox = nodes[leaf].box;
+        int index = root;
+        while (!nodes[index].isLeaf()) {
+            int child1 = nodes[index].child1;
+            int child2 = nodes[index].child2;
+
+            float area = nodes[index].box.surfaceArea();
+            float combinedArea = AABB::merge(nodes[index].box, leafBox).surfaceArea();
+            float cost = 2.0f * combinedArea;
+            float inheritanceCost = 2.0f * (combinedArea - area);
+
+            float cost1 = childCost(child1, leafBox) + inheritanceCost;
+            float cost2 = childCost(child2, leafBox) + inheritanceCost;
+
+            if (cost < cost1 && cost < cost2) break;
+            index = cost1 < cost2 ? child1 : child2;
+        }
+
+        int sibling = index;
+        int oldParent = nodes[sibling].parent;
+        int newParent = allocateNode();
+        nodes[newParent].parent = oldParent;
+        nodes[newParent].box = AABB::merge(leafBox, nodes[sibling].box);
+        nodes[newParent].height = nodes[sibling].height + 1;
+        nodes[newParent].child1 = sibling;
+        nodes[newParent].child2 = leaf;
+        nodes[sibling].parent = newParent;
+        nodes[leaf].parent = newParent;
+
+        if (oldParent != -1) {
+            if (nodes[oldParent].child1 == sibling) nodes[oldParent].child1 = newParent;
+            else nodes[oldParent].child2 = newParent;
+        }
+        else {
+            root = newParent;
+        }
+
+        refitAncestors(nodes[leaf].parent);
+    }
+
+    float childCost(int child, const AABB& leafBox) const {
+        float merged = AABB::merge(leafBox, nodes[child].box).surfaceArea();
+        return nodes[child].isLeaf() ? merged : merged - nodes[child].box.surfaceArea();
+    }
+
+    void removeLeaf(int leaf) {
+        if (leaf == root) {
+            root = -1;
+            return;
+        }
+
+        int parent = nodes[leaf].parent;
+        int grandParent = nodes[parent].parent;
+        int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+        if (grandParent != -1) {
+            if (nodes[grandParent].child1 == parent) nodes[grandParent].child1 = sibling;
+            else nodes[grandParent].child2 = sibling;
+            nodes[sibling].parent = grandParent;
+            freeNode(parent);
+            refitAncestors(grandParent);
+        }
+        else {
+            root = sibling;
+            nodes[sibling].parent = -1;
+            freeNode(parent);
+        }
+    }
+
+    void refitAncestors(int index) {
+        while (index != -1) {
+            index = balance(index);
+
+            int child1 = nodes[index].child1;
+            int child2 = nodes[index].child2;
+            nodes[index].height = 1 + std::max(nodes[child1].height, nodes[child2].height);
+            nodes[index].box = AABB::merge(nodes[child1].box, nodes[child2].box);
+
+            index = nodes[index].parent;
+        }
+    }
+
+    // Rotates a grandchild up if one subtree of A is more than one level taller
+    int balance(int iA) {
+        Node& A = nodes[iA];
+        if (A.isLeaf() || A.height < 2) return iA;
+
+        int iB = A.child1;
+        int iC = A.child2;
+        int diff = nodes[iC].height - nodes[iB].height;
+
+        if (diff > 1) return rotate(iA, iC, iB);
+        if (diff < -1) return rotate(iA, iB, iC);
+        return iA;
+    }
+
+    // Promotes the taller child `up` of A above A; `other` stays below A
+    int rotate(int iA, int iUp, int iOther) {
+        int iF = nodes[iUp].child1;
+        int iG = nodes[iUp].child2;
+
+        nodes[iUp].child1 = iA;
+        nodes[iUp].parent = nodes[iA].parent;
+        nodes[iA].parent = iUp;
+
+        if (nodes[iUp].parent != -1) {
+            int p = nodes[iUp].parent;
+            if (nodes[p].child1 == iA) nodes[p].child1 = iUp;
+            else nodes[p].child2 = iUp;
+        }
+        else {
+            root = iUp;
+        }
+
+        // Keep the taller grandchild next to `up`, move the shorter one under A
+        int keep = nodes[iF].height > nodes[iG].height ? iF : iG;
+        int move = keep == iF ? iG : iF;
+
+        nodes[iUp].child2 = keep;
+        if (nodes[iA].child1 == iUp) nodes[iA].child1 = move;
+        else nodes[iA].child2 = move;
+        nodes[move].parent = iA;
+
+        nodes[iA].box = AABB::merge(nodes[iOther].box, nodes[move].box);
+        nodes[iA].height = 1 + std::max(nodes[iOther].height, nodes[move].height);
+        nodes[iUp].box = AABB::merge(nodes[iA].box, nodes[keep].box);
+        nodes[iUp].height = 1 + std::max(nodes[iA].height, nodes[keep].height);
+
+        return iUp;
+    }
+
+    AABB fatten(const AABB& box) const {
+        return AABB(Vertex(box.min.x - margin, box.min.y - margin, box.min.z - margin),
+            Vertex(box.max.x + margin, box.max.y + margin, box.max.z + margin));
+    }
+
+public:
+    DynamicAabbTree(float margin = 0.1f) : root(-1), freeList(-1), margin(margin) {}
+
+    int createProxy(const AABB& box, uint32_t userData) {
+        int proxy = allocateNode();
+        nodes[proxy].box = fatten(box);
+        nodes[proxy].userData = userData;
+        insertLeaf(proxy);
+        return proxy;
+    }
+
+    void destroyProxy(int proxy) {
+        removeLeaf(proxy);
+        freeNode(proxy);
+    }
+
+    // Refits the proxy; only reinserts when the box leaves its fat bounds
+    bool moveProxy(int proxy, const AABB& box) {
+        if (nodes[proxy].box.contains(box)) return false;
+
+        removeLeaf(proxy);
+        nodes[proxy].box = fatten(box);
+        insertLeaf(proxy);
+        return true;
+    }
+
+    void setUserData(int proxy, uint32_t userData) {
+        nodes[proxy].userData = userData;
+    }
+
+    void clear() {
+        nodes.clear();
+        root = -1;
+        freeList = -1;
+    }
+
+    int getHeight() const {
+        return root == -1 ? 0 : nodes[root].height;
+    }
+
+    // Collects the user data of every leaf that may be visible. Subtrees that
+    // are fully inside the frustum are emitted without further plane tests.
+    void queryFrustum(const Frustum& frustum, std::vector<uint32_t>& result, CullingStats& stats) const {
+        if (root == -1) return;
+
+        NodeStack stack;
+        stack.push(root);
+
+        while (!stack.empty()) {
+            int index = stack.pop();
+            const Node& node = nodes[index];
+
+            stats.tested++;
+            Frustum::Containment containment = frustum.classify(node.box);
+            if (containment == Frustum::OUTSIDE) continue;
+
+            if (node.isLeaf()) {
+                result.push_back(node.userData);
+            }
+            else if (containment == Frustum::INSIDE) {
+                collectLeaves(index, result);
+            }
+            else {
+                stack.push(node.child1);
+                stack.push(node.child2);
+            }
+        }
+    }
+
+    // Closest-hit traversal. leafTest(userData, tMax) returns the exact hit
+    // distance for a leaf or a negative value; nodes the ray enters beyond
+    // the closest hit so far are skipped.
+    template <typename LeafTest>
+    void raycast(const Ray& ray, float tMax, LeafTest leafTest) const {
+        if (root == -1) return;
+
+        NodeStack stack;
+        stack.push(root);
+
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.pop()];
+
+            float tEntry;
+            if (!ray.intersects(node.box, tMax, tEntry)) continue;
+
+            if (node.isLeaf()) {
+                float t = leafTest(node.userData, tMax);
+                if (t >= 0.0f && t < tMax) tMax = t;
+            }
+            else {
+                stack.push(node.child1);
+                stack.push(node.child2);
+            }
+        }
+    }
+
+    void collectLeaves(int subtree, std::vector<uint32_t>& result) const {
+        NodeStack stack;
+        stack.push(subtree);
+
+        while (!stack.empty()) {
+            const Node& node = nodes[stack.pop()];
+            if (node.isLeaf()) {
+                result.push_back(node.userData);
+            }
+            else {
+                stack.push(node.child1);
+                stack.push(node.child2);
+            }
+        }
+    }
+};
+
+// Data-oriented scene storage. Per-object attributes live in parallel dense
+// arrays that passes iterate directly; a slot map translates stable handles
+// to dense indices, which change when destroy() swaps the last object down.
+class SceneStore {
+public:
+    enum Flags { FLAG_SELECTED = 1, FLAG_HOVERED = 2 };
+
+private:
+    struct Slot {
+        uint32_t denseIndex;
+        uint32_t generation;
+    };
+
+    std::vector<Vertex> positions;
+    std::vector<float> scales;
+    std::vector<Color> colors;
+    std::vector<int> ids;
+    std::vector<int> proxies;
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> denseToSlot;
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> freeSlots;
+    IdIndexMap idToSlot;
+    DynamicAabbTree tree;
+
+    CubeMesh mesh;
+    uint64_t version;  // bumped whenever object geometry changes
+
+    static AABB boundsOf(const Vertex& pos, float scale) {
+        return AABB(Vertex(pos.x - scale, pos.y - scale, pos.z - scale),
+            Vertex(pos.x + scale, pos.y + scale, pos.z + scale));
+    }
+
+public:
+    SceneStore() : version(0) {}
+
+    uint64_t getVersion() const { return version; }
+
+    void reserve(size_t capacity) {
+        positions.reserve(capacity);
+        scales.reserve(capacity);
+        colors.reserve(capacity);
+        ids.reserve(capacity);
+        proxies.reserve(capacity);
+        flags.reserve(capacity);
+        denseToSlot.reserve(capacity);
+        slots.reserve(capacity);
+    }
+
+    ObjectHandle create(const Vertex& pos, const Color& color, int id, float scale = 1.0f) {
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            slot = static_cast<uint32_t>(slots.size());
+            Slot fresh = { 0, 0 };
+            slots.push_back(fresh);
+        }
+
+        uint32_t dense = static_cast<uint32_t>(positions.size());
+        slots[slot].denseIndex = dense;
+
+        positions.push_back(pos);
+        scales.push_back(scale);
+        colors.push_back(color);
+        ids.push_back(id);
+        proxies.push_back(tree.createProxy(boundsOf(pos, scale), slot));
+        flags.push_back(0);
+        denseToSlot.push_back(slot);
+        idToSlot.insert(id, slot);
+        version++;
+
+        return ObjectHandle(slot, slots[slot].generation);
+    }
+
+    bool destroy(ObjectHandle handle) {
+        int index = indexOf(handle);
+        if (index < 0) return false;
+
+        uint32_t dense = static_cast<uint32_t>(index);
+        uint32_t last = static_cast<uint32_t>(positions.size() - 1);
+
+        idToSlot.erase(ids[dense]);
+        tree.destroyProxy(proxies[dense]);
+
+        if (dense != last) {
+            positions[dense] = positions[last];
+            scales[dense] = scales[last];
+            colors[dense] = colors[last];
+            ids[dense] = ids[last];
+            proxies[dense] = proxies[last];
+            flags[dense] = flags[last];
+            denseToSlot[dense] = denseToSlot[last];
+            slots[denseToSlot[dense]].denseIndex = dense;
+        }
+
+        positions.pop_back();
+        scales.pop_back();
+        colors.pop_back();
+        ids.pop_back();
+        proxies.pop_back();
+        flags.pop_back();
+        denseToSlot.pop_back();
+
+        slots[handle.slot].generation++;
+        freeSlots.push_back(handle.slot);
+        version++;
+        return true;
+    }
+
+    void clear() {
+        while (!positions.empty()) {
+            destroy(handleAt(positions.size() - 1));
+        }
+    }
+
+    // Dense index of a live handle, or -1 if it is stale
+    int indexOf(ObjectHandle handle) const {
+        if (handle.slot >= slots.size() || slots[handle.slot].generation != handle.generation) {
+            return -1;
+        }
+        return static_cast<int>(slots[handle.slot].denseIndex);
+    }
+
+    // Dense index of the object with the given ID, or -1
+    int findById(int id) const {
+        uint32_t slot;
+        if (!idToSlot.find(id, slot)) return -1;
+        return static_cast<int>(slots[slot].denseIndex);
+    }
+
+    ObjectHandle handleAt(size_t index) const {
+        uint32_t slot = denseToSlot[index];
+        return ObjectHandle(slot, slots[slot].generation);
+    }
+
+    size_t size() const { return positions.size(); }
+
+    const Vertex& getPosition(size_t index) const { return positions[index]; }
+    float getScale(size_t index) const { return scales[index]; }
+    int getObjectId(size_t index) const { return ids[index]; }
+    Color getDiffuseColor(size_t index) const { return colors[index]; }
+    AABB getBounds(size_t index) const { return boundsOf(positions[index], scales[index]); }
+    int getTreeHeight() const { return tree.getHeight(); }
+
+    bool isSelected(size_t index) const { return (flags[index] & FLAG_SELECTED) != 0; }
+
+    void setSelected(size_t index, bool selected) {
+        if (selected) flags[index] |= FLAG_SELECTED;
+        else flags[index] &= ~FLAG_SELECTED;
+    }
+
+    bool isHovered(size_t index) const { return (flags[index] & FLAG_HOVERED) != 0; }
+
+    void setHovered(size_t index, bool hovered) {
+        if (hovered) flags[index] |= FLAG_HOVERED;
+        else flags[index] &= ~FLAG_HOVERED;
+    }
+
+    void clearSelection() {
+        for (size_t i = 0; i < flags.size(); i++) {
+            flags[i] &= ~FLAG_SELECTED;
+        }
+    }
+
+    void setPosition(size_t index, const Vertex& pos) {
+        positions[index] = pos;
+        tree.moveProxy(proxies[index], boundsOf(pos, scales[index]));
+        version++;
+    }
+
+    // Closest object along the ray, tested exactly against its cube. Returns
+    // the dense index, or -1 when the ray misses everything.
+    int raycast(const Ray& ray, Vertex& hitPoint) const {
+        int hitIndex = -1;
+        float hitDistance = 0.0f;
+
+        tree.raycast(ray, 1e30f, [&](uint32_t slot, float tMax) -> float {
+            uint32_t index = slots[slot].denseIndex;
+            float t;
+            if (!ray.intersects(boundsOf(positions[index], scales[index]), tMax, t)) return -1.0f;
+
+            hitIndex = static_cast<int>(index);
+            hitDistance = t;
+            return t;
+        });
+
+        if (hitIndex != -1) hitPoint = ray.at(hitDistance);
+        return hitIndex;
+    }
+
+    // Dense indices of the objects whose bounds touch the frustum
+    void cull(const Frustum& frustum, std::vector<uint32_t>& visible, CullingStats& stats) const {
+        visible.clear();
+        tree.queryFrustum(frustum, visible, stats);
+        for (size_t i = 0; i < visible.size(); i++) {
+            visible[i] = slots[visible[i]].denseIndex;
+        }
+        stats.visible = static_cast<int>(visible.size());
+    }
+
+    void setDiffuseColor(size_t index, const Color& color) {
+        const Color& old = colors[index];
+        std::cout << "Changing object " << ids[index] << " color from "
+            << "R=" << old.r << " G=" << old.g << " B=" << old.b
+            << " to R=" << color.r << " G=" << color.g << " B=" << color.b << std::endl;
+        colors[index] = color;
+    }
+
+    // Materials are keyed by their diffuse color quantized to 8 bits per
+    // channel, followed by the flag bits that change how the object is shaded
+    uint32_t getMaterialKey(size_t index) const {
+        const Color& c = colors[index];
+        uint32_t r = static_cast<uint32_t>(std::min(std::max(c.r, 0.0f), 1.0f) * 255.0f + 0.5f);
+        uint32_t g = static_cast<uint32_t>(std::min(std::max(c.g, 0.0f), 1.0f) * 255.0f + 0.5f);
+        uint32_t b = static_cast<uint32_t>(std::min(std::max(c.b, 0.0f), 1.0f) * 255.0f + 0.5f);
+        return (((r << 16) | (g << 8) | b) << 2) | flags[index];
+    }
+
+    void applyMaterial(size_t index) const {
+        //     
+        const Color& diffuseColor = colors[index];
+        float ambient[] = { diffuseColor.r * 0.3f, diffuseColor.g * 0.3f, diffuseColor.b * 0.3f, 1.0f };
+        float diffuse[] = { diffuseColor.r, diffuseColor.g, diffuseColor.b, 1.0f };
+        float specular[] = { 0.8f, 0.8f, 0.8f, 1.0f };
+        float shininess = 50.0f;
+        float emission[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+        if (flags[index] & FLAG_SELECTED) {
+            emission[0] = 0.35f;
+            emission[1] = 0.3f;
+        }
+        if (flags[index] & FLAG_HOVERED) {
+            for (int i = 0; i < 3; i++) emission[i] += 0.15f;
+        }
+
+        glMaterialfv(GL_FRONT, GL_AMBIENT, ambient);
+        glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
+        glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
+        glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+        glMaterialfv(GL_FRONT, GL_EMISSION, emission);
+    }
+
+    // Intersects the ray with one triangle of the object's mesh
+    // (Moller-Trumbore, no backface rejection). On a hit, barycentric holds
+    // the weights of the triangle's three corners.
+    bool intersectTriangle(size_t index, int triangle, const Ray& ray, Vertex& barycentric, Vertex& hitPoint) const {
+        if (triangle < 0 || triangle >= mesh.getTriangleCount()) return false;
+
+        Vertex corners[3];
+        mesh.getTriangle(triangle, corners[0], corners[1], corners[2]);
+        for (int i = 0; i < 3; i++) {
+            corners[i] = Vertex(positions[index].x + corners[i].x * scales[index],
+                positions[index].y + corners[i].y * scales[index],
+                positions[index].z + corners[i].z * scales[index]);
+        }
+
+        Vertex e1(corners[1].x - corners[0].x, corners[1].y - corners[0].y, corners[1].z - corners[0].z);
+        Vertex e2(corners[2].x - corners[0].x, corners[2].y - corners[0].y, corners[2].z - corners[0].z);
+        const Vertex& d = ray.direction;
+        Vertex p(d.y * e2.z - d.z * e2.y, d.z * e2.x - d.x * e2.z, d.x * e2.y - d.y * e2.x);
+        float det = e1.x * p.x + e1.y * p.y + e1.z * p.z;
+        if (fabsf(det) < 1e-12f) return false;
+
+        float invDet = 1.0f / det;
+        Vertex s(ray.origin.x - corners[0].x, ray.origin.y - corners[0].y, ray.origin.z - corners[0].z);
+        float u = (s.x * p.x + s.y * p.y + s.z * p.z) * invDet;
+        Vertex q(s.y * e1.z - s.z * e1.y, s.z * e1.x - s.x * e1.z, s.x * e1.y - s.y * e1.x);
+        float v = (d.x * q.x + d.y * q.y + d.z * q.z) * invDet;
+        float t = (e2.x * q.x + e2.y * q.y + e2.z * q.z) * invDet;
+
+        barycentric = Vertex(1.0f - u - v, u, v);
+        hitPoint = ray.at(t);
+        return true;
+    }
+
+    // Draws the object with whatever color/material state is current
+    void drawGeometry(size_t index, bool pickingMode) const {
+        const Vertex& position = positions[index];
+        float scale = scales[index];
+
+        glPushMatrix();
+        glTranslatef(position.x, position.y, position.z);
+        glScalef(scale, scale, scale);
+        mesh.draw(pickingMode);
+        glPopMatrix();
+    }
+};
+
+// Per-frame list of draw items ordered by a 64-bit state key, most
+// significant field first:
+//   [63..62] pass | [61..56] shader | [55..30] material | [29..14] depth bucket
+// Sorting groups items that share GPU state, so submission only reprograms
+// the material when the key changes, and orders each group front to back.
+class RenderQueue {
+public:
+    enum Pass { PASS_OPAQUE = 0 };
+
+    struct DrawItem {
+        uint64_t key;
+        uint32_t index;
+    };
+
+private:
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> scratch;
+
+public:
+    static uint64_t makeKey(uint32_t pass, uint32_t shader, uint32_t material, uint32_t depthBucket) {
+        return (uint64_t(pass & 0x3) << 62) | (uint64_t(shader & 0x3F) << 56)
+            | (uint64_t(material & 0x3FFFFFF) << 30) | (uint64_t(depthBucket & 0xFFFF) << 14);
+    }
+
+    // Everything above the depth bucket identifies the GPU state of an item
+    static uint64_t stateOf(uint64_t key) {
+        return key >> 30;
+    }
+
+    void clear() {
+        items.clear();
+    }
+
+    void push(uint64_t key, uint32_t index) {
+        DrawItem item = { key, index };
+        items.push_back(item);
+    }
+
+    // LSD radix sort, one byte per pass; bytes that are equal across all
+    // items (e.g. the unused low bits) are skipped entirely
+    void sort() {
+        size_t count = items.size();
+        scratch.resize(count);
+
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t histogram[256] = {};
+            for (size_t i = 0; i < count; i++) {
+                histogram[(items[i].key >> shift) & 0xFF]++;
+            }
+            if (count == 0 || histogram[(items[0].key >> shift) & 0xFF] == count) continue;
+
+            size_t offset = 0;
+            for (int b = 0; b < 256; b++) {
+                size_t n = histogram[b];
+                histogram[b] = offset;
+                offset += n;
+            }
+            for (size_t i = 0; i < count; i++) {
+                scratch[histogram[(items[i].key >> shift) & 0xFF]++] = items[i];
+            }
+            items.swap(scratch);
+        }
+    }
+
+    const std::vector<DrawItem>& getItems() const {
+        return items;
+    }
+};
+
+struct RenderQueueStats {
+    int items;
+    int stateChanges;
+    double sortMs;
+
+    RenderQueueStats() : items(0), stateChanges(0), sortMs(0.0) {}
+};
+
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        std::cout << "Shader compilation failed: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Links a vertex/fragment pair; fragment outputs are bound to draw buffers in
+// the order given. Returns 0 (and logs) on failure.
+GLuint createProgram(const char* vertexSource, const char* fragmentSource, const std::vector<const char*>& outputs) {
+    GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    if (!vs || !fs) {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        glBindFragDataLocation(program, static_cast<GLuint>(i), outputs[i]);
+    }
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        std::cout << "Program link failed: " << log << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+struct PickResult {
+    int mouseX, mouseY;
+    int objectId;      // 0 when the cursor is over the background
+    int objectIndex;   // dense scene index at delivery time, or -1
+    double latencyMs;  // request to delivery
+    bool hasHitPoint;
+    Vertex hitPoint;
+    int triangleIndex;     // triangle of the object's mesh under the cursor, or -1
+    bool hasBarycentrics;  // weights of that triangle's corners at the hit point
+    Vertex barycentric;
+
+    PickResult() : mouseX(0), mouseY(0), objectId(0), objectIndex(-1), latencyMs(0.0), hasHitPoint(false),
+        triangleIndex(-1), hasBarycentrics(false) {}
+};
+
+// ID pass: 32-bit object ID plus the triangle index within the draw call
+const char* pickVertexShader = R"(
+#version 150 compatibility
+void main() {
+    gl_Position = ftransform();
+}
+)";
+
+const char* pickFragmentShader = R"(
+#version 150 compatibility
+uniform uint objectId;
+out uvec2 fragId;
+
+void main() {
+    fragId = uvec2(objectId, uint(gl_PrimitiveID));
+}
+)";
+
+typedef std::function<void(const PickResult&)> PickCallback;
+
+// Renders object and triangle IDs for the pixel under the cursor only. A pick matrix
+// stretches that pixel over a 1x1 target, so the cost does not depend on the
+// window resolution, and only objects whose bounds meet the pick frustum
+// (the cursor ray) are drawn. Readbacks go through a pool of PBOs guarded by
+// fences that grows while every buffer is in flight, so a click never
+// stalls on the GPU. IDs are written as RG32UI
+// (object, triangle); the barycentrics are recovered on the CPU by
+// intersecting the cursor ray with that one triangle.
+class PickingSystem {
+private:
+    static const int PICK_REGION = 1;
+    static const int INITIAL_PENDING_PICKS = 4;
+
+    struct PendingPick {
+        GLuint pbo;
+        GLsync fence;  // non-null while the pick is in flight
+        int mouseX, mouseY;
+        int sequence;  // request order, so picks are delivered in order
+        Ray ray;
+        PickCallback callback;
+        std::chrono::high_resolution_clock::time_point requestTime;
+
+        PendingPick() : pbo(0), fence(0), mouseX(0), mouseY(0), sequence(0) {}
+    };
+
+    GLuint fbo;
+    GLuint colorBuffer;
+    GLuint depthBuffer;
+    GLuint pickProgram;
+    GLint objectIdLocation;
+    int windowWidth, windowHeight;
+    std::vector<uint32_t> candidates;
+    std::vector<PendingPick> pendingPicks;
+    int nextSequence;
+    int passPicks, idBufferPicks;  // click picks only
+    int hoverPicks;
+
+public:
+    PickingSystem() : fbo(0), colorBuffer(0), depthBuffer(0), pickProgram(0), objectIdLocation(-1),
+        windowWidth(800), windowHeight(600), nextSequence(0), passPicks(0), idBufferPicks(0), hoverPicks(0) {}
+
+    bool initialize() {
+        std::vector<const char*> outputs = { "fragId" };
+        pickProgram = createProgram(pickVertexShader, pickFragmentShader, outputs);
+        if (!pickProgram) return false;
+        objectIdLocation = glGetUniformLocation(pickProgram, "objectId");
+
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+        // Color buffer
+        glGenTextures(1, &colorBuffer);
+        glBindTexture(GL_TEXTURE_2D, colorBuffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, PICK_REGION, PICK_REGION, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorBuffer, 0);
+
+        // Depth buffer
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, PICK_REGION, PICK_REGION);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Framebuffer is not complete! Status: " << status << std::endl;
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            return false;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        for (int i = 0; i < INITIAL_PENDING_PICKS; i++) addSlot();
+
+        std::cout << "FBO initialized successfully!" << std::endl;
+        return true;
+    }
+
+    // Queues an ID render for the pixel under the cursor and starts an
+    // asynchronous readback into a pixel buffer object. The callback runs
+    // from pollPicks() once the GPU has finished, usually a frame later.
+    // Hover queries are counted apart from clicks.
+    void requestPick(int mouseX, int mouseY, const SceneStore& scene, const Matrix4& projection, const Matrix4& view,
+        const PickCallback& callback, bool hover = false) {
+        PendingPick& pick = acquireSlot();
+
+        // Pick frustum around the pixel center under the cursor
+        int viewport[4] = { 0, 0, windowWidth, windowHeight };
+        Matrix4 pickProjection = Matrix4::pickMatrix(mouseX + 0.5f, windowHeight - mouseY - 0.5f,
+            float(PICK_REGION), float(PICK_REGION), viewport) * projection;
+
+        CullingStats stats;
+        scene.cull(Frustum(pickProjection * view), candidates, stats);
+
+        //   FBO
+        GLint oldFbo;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+        GLint oldViewport[4];
+        glGetIntegerv(GL_VIEWPORT, oldViewport);
+
+        //   FBO  
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+        //  (ID = 0)
+        GLuint noObject[] = { 0, 0, 0, 0 };
+        glClearBufferuiv(GL_COLOR, 0, noObject);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        //  
+        glViewport(0, 0, PICK_REGION, PICK_REGION);
+
+        setupPickingView(pickProjection, view);
+
+        //     ID
+        glUseProgram(pickProgram);
+        for (uint32_t index : candidates) {
+            glUniform1ui(objectIdLocation, static_cast<GLuint>(scene.getObjectId(index)));
+            scene.drawGeometry(index, true);
+        }
+        glUseProgram(0);
+
+        Ray ray = Ray::fromWindow(mouseX, mouseY, windowWidth, windowHeight, projection, view);
+        startReadback(pick, PICK_REGION / 2, PICK_REGION / 2, mouseX, mouseY, ray, callback);
+        if (hover) hoverPicks++;
+        else passPicks++;
+
+        //   FBO
+        glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+        glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
+    }
+
+    // Reads the ID under the cursor from an ID attachment that the lit pass
+    // already filled, so the pick costs no geometry pass at all
+    void requestPickFromIdBuffer(int mouseX, int mouseY, GLuint framebuffer, GLenum attachment,
+        const SceneStore& scene, const Matrix4& projection, const Matrix4& view, const PickCallback& callback,
+        bool hover = false) {
+        PendingPick& pick = acquireSlot();
+
+        int x = std::min(std::max(mouseX, 0), windowWidth - 1);
+        int y = std::min(std::max(windowHeight - mouseY - 1, 0), windowHeight - 1);
+
+        GLint oldReadFbo;
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &oldReadFbo);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glReadBuffer(attachment);
+
+        Ray ray = Ray::fromWindow(mouseX, mouseY, windowWidth, windowHeight, projection, view);
+        startReadback(pick, x, y, mouseX, mouseY, ray, callback);
+        if (hover) hoverPicks++;
+        else idBufferPicks++;
+
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, oldReadFbo);
+    }
+
+    int getPassPickCount() const { return passPicks; }
+    int getIdBufferPickCount() const { return idBufferPicks; }
+    int getHoverPickCount() const { return hoverPicks; }
+
+    // Delivers, oldest first, every pick whose readback has completed;
+    // never blocks. Fences signal in submission order, so the first one
+    // still pending ends the scan.
+    void pollPicks(const SceneStore& scene) {
+        for (;;) {
+            int oldest = -1;
+            for (size_t i = 0; i < pendingPicks.size(); i++) {
+                if (pendingPicks[i].fence && (oldest == -1 || pendingPicks[i].sequence < pendingPicks[oldest].sequence)) {
+                    oldest = static_cast<int>(i);
+                }
+            }
+            if (oldest == -1) return;
+
+            GLenum status = glClientWaitSync(pendingPicks[oldest].fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+            deliver(pendingPicks[oldest], scene);
+        }
+    }
+
+    bool hasPendingPicks() const {
+        for (const PendingPick& pick : pendingPicks) {
+            if (pick.fence) return true;
+        }
+        return false;
+    }
+
+    void cleanup() {
+        for (PendingPick& pick : pendingPicks) {
+            if (pick.fence) glDeleteSync(pick.fence);
+            if (pick.pbo) glDeleteBuffers(1, &pick.pbo);
+        }
+        pendingPicks.clear();
+        if (fbo) glDeleteFramebuffers(1, &fbo);
+        if (colorBuffer) glDeleteTextures(1, &colorBuffer);
+        if (depthBuffer) glDeleteRenderbuffers(1, &depthBuffer);
+        if (pickProgram) glDeleteProgram(pickProgram);
+    }
+
+    // The pick target does not depend on the window size, so nothing is reallocated
+    void setWindowSize(int width, int height) {
+        windowWidth = width;
+        windowHeight = height;
+    }
+
+private:
+    void addSlot() {
+        PendingPick pick;
+        glGenBuffers(1, &pick.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pick.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(GLuint), NULL, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        pendingPicks.push_back(pick);
+    }
+
+    // A free PBO, or a new one when every pick is still in flight, so a
+    // burst of clicks never waits on the GPU. The reference is only valid
+    // until the next acquireSlot().
+    PendingPick& acquireSlot() {
+        for (PendingPick& pick : pendingPicks) {
+            if (!pick.fence) return pick;
+        }
+        addSlot();
+        return pendingPicks.back();
+    }
+
+    // Copies one pixel of the current read buffer into the pick's PBO; the
+    // CPU does not wait for it here
+    void startReadback(PendingPick& pick, int readX, int readY, int mouseX, int mouseY, const Ray& ray,
+        const PickCallback& callback) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pick.pbo);
+        glReadPixels(readX, readY, 1, 1, GL_RG_INTEGER, GL_UNSIGNED_INT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        pick.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pick.mouseX = mouseX;
+        pick.mouseY = mouseY;
+        pick.sequence = nextSequence++;
+        pick.ray = ray;
+        pick.callback = callback;
+        pick.requestTime = std::chrono::high_resolution_clock::now();
+        glFlush();
+    }
+
+    void deliver(PendingPick& pick, const SceneStore& scene) {
+        GLuint pixel[2] = { 0, 0 };
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pick.pbo);
+        void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(pixel), GL_MAP_READ_BIT);
+        if (data) {
+            memcpy(pixel, data, sizeof(pixel));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        glDeleteSync(pick.fence);
+        pick.fence = 0;
+
+        PickResult result;
+        result.mouseX = pick.mouseX;
+        result.mouseY = pick.mouseY;
+        result.objectId = static_cast<int>(pixel[0]);
+        result.objectIndex = result.objectId != 0 ? scene.findById(result.objectId) : -1;
+        if (result.objectIndex != -1) {
+            result.triangleIndex = static_cast<int>(pixel[1]);
+            result.hasBarycentrics = scene.intersectTriangle(result.objectIndex, result.triangleIndex, pick.ray,
+                result.barycentric, result.hitPoint);
+            result.hasHitPoint = result.hasBarycentrics;
+        }
+        result.latencyMs = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - pick.requestTime).count();
+
+        PickCallback callback;
+        callback.swap(pick.callback);
+        if (callback) callback(result);
+    }
+
+    // Same matrices as the lit pass, so the pick matches what is on screen
+    void setupPickingView(const Matrix4& projection, const Matrix4& view) {
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixf(projection.m);
+
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixf(view.m);
+    }
+};
+
+// Fixed-function GL_LIGHT0 + glMaterial lighting, evaluated per fragment,
+// that also writes the object ID into a second color attachment
+const char* litVertexShader = R"(
+#version 150 compatibility
+out vec3 eyePosition;
+out vec3 eyeNormal;
+
+void main() {
+    eyePosition = vec3(gl_ModelViewMatrix * gl_Vertex);
+    eyeNormal = gl_NormalMatrix * gl_Normal;
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
+)";
+
+const char* litFragmentShader = R"(
+#version 150 compatibility
+uniform uint objectId;
+in vec3 eyePosition;
+in vec3 eyeNormal;
+out vec4 fragColor;
+out uvec2 fragId;
+
+void main() {
+    vec3 n = normalize(eyeNormal);
+    vec4 lightPosition = gl_LightSource[0].position;
+    vec3 l = normalize(lightPosition.xyz - eyePosition * lightPosition.w);
+    float nDotL = max(dot(n, l), 0.0);
+
+    vec4 color = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient
+        + gl_FrontLightProduct[0].diffuse * nDotL;
+    if (nDotL > 0.0) {
+        vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));
+        color += gl_FrontLightProduct[0].specular * pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess);
+    }
+
+    fragColor = vec4(color.rgb, gl_FrontMaterial.diffuse.a);
+    fragId = uvec2(objectId, uint(gl_PrimitiveID));
+}
+)";
+
+// GL_TIME_ELAPSED queries kept in a small ring. Results are collected a few
+// frames late, once the GPU has them, so timing never stalls the CPU.
+class GpuTimer {
+private:
+    static const int QUERY_COUNT = 4;
+
+    GLuint queries[QUERY_COUNT];
+    bool issued[QUERY_COUNT];
+    int next;
+    bool active;
+    int samples;
+    double smoothedMs;
+
+    void collect() {
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            int slot = (next + i) % QUERY_COUNT;  // oldest first
+            if (!issued[slot]) continue;
+
+            GLint available = 0;
+            glGetQueryObjectiv(queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &ns);
+            issued[slot] = false;
+
+            // The first sample includes driver warm-up (shader and target creation)
+            if (samples++ == 0) continue;
+            double ms = ns / 1.0e6;
+            smoothedMs = smoothedMs > 0.0 ? smoothedMs * 0.9 + ms * 0.1 : ms;
+        }
+    }
+
+public:
+    GpuTimer() : next(0), active(false), samples(0), smoothedMs(0.0) {
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            queries[i] = 0;
+            issued[i] = false;
+        }
+    }
+
+    void initialize() {
+        if (!queries[0]) glGenQueries(QUERY_COUNT, queries);
+    }
+
+    void begin() {
+        if (!queries[0]) return;
+        collect();
+
+        // Skip this sample rather than wait if the ring is still full
+        active = !issued[next];
+        if (active) glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    }
+
+    void end() {
+        if (!active) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        issued[next] = true;
+        next = (next + 1) % QUERY_COUNT;
+        active = false;
+    }
+
+    // Smoothed GPU time in milliseconds, 0 until the first result arrives
+    double getMs() const { return smoothedMs; }
+
+    void cleanup() {
+        if (queries[0]) glDeleteQueries(QUERY_COUNT, queries);
+        for (int i = 0; i < QUERY_COUNT; i++) {
+            queries[i] = 0;
+            issued[i] = false;
+        }
+        samples = 0;
+        smoothedMs = 0.0;
+    }
+};
+
+// Pool of 2D texture attachments handed out by format, sample count and size.
+// Allocations are rounded up to size buckets, so resizing the window reuses
+// the same textures until a bucket boundary is crossed, and a target is
+// only reallocated smaller after it has been handed out oversized for
+// SHRINK_AFTER_USES consecutive acquisitions. Passes acquire their targets,
+// render and release them, so a released target can back a later pass in
+// the same frame. Framebuffers are cached by attachment set and validated
+// once, when they are created.
+class RenderTargetPool {
+public:
+    static const int MAX_COLOR_ATTACHMENTS = 2;
+
+private:
+    struct Entry {
+        GLuint texture;
+        GLenum internalFormat;
+        int samples;
+        int width, height;  // allocated size, a whole bucket
+        bool inUse;
+        int oversizedUses;
+        uint64_t lastUsedFrame;
+    };
+
+    struct CachedFramebuffer {
+        GLuint fbo;
+        GLuint colors[MAX_COLOR_ATTACHMENTS];
+        GLuint depth;
+    };
+
+    static const int SHRINK_AFTER_USES = 60;
+    static const int EVICT_AFTER_FRAMES = 300;
+
+    std::vector<Entry> entries;
+    std::vector<CachedFramebuffer> framebuffers;
+    uint64_t frame;
+    int allocations;
+
+    // Small targets (pick regions) are exact; screen-sized ones grow in 256 pixel steps
+    static int bucketSize(int size) {
+        return size <= 64 ? size : (size + 255) & ~255;
+    }
+
+    static void pixelFormatOf(GLenum internalFormat, GLenum& format, GLenum& type) {
+        switch (internalFormat) {
+        case GL_RG32UI: format = GL_RG_INTEGER; type = GL_UNSIGNED_INT; break;
+        case GL_R32UI: format = GL_RED_INTEGER; type = GL_UNSIGNED_INT; break;
+        case GL_DEPTH_COMPONENT24: format = GL_DEPTH_COMPONENT; type = GL_UNSIGNED_INT; break;
+        case GL_RGBA16F: format = GL_RGBA; type = GL_HALF_FLOAT; break;
+        default: format = GL_RGBA; type = GL_UNSIGNED_BYTE; break;
+        }
+    }
+
+    static size_t bytesPerPixel(GLenum internalFormat) {
+        switch (internalFormat) {
+        case GL_RG32UI: case GL_RGBA16F: return 8;
+        default: return 4;
+        }
+    }
+
+    void allocate(Entry& entry, int width, int height) {
+        glGenTextures(1, &entry.texture);
+        if (entry.samples > 1) {
+            glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, entry.texture);
+            glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, entry.samples, entry.internalFormat, width, height, GL_TRUE);
+            glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+        }
+        else {
+            GLenum format, type;
+            pixelFormatOf(entry.internalFormat, format, type);
+
+            glBindTexture(GL_TEXTURE_2D, entry.texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, entry.internalFormat, width, height, 0, format, type, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        entry.width = width;
+        entry.height = height;
+        entry.oversizedUses = 0;
+        allocations++;
+    }
+
+    // Deletes a texture together with every cached framebuffer that uses it
+    void destroyTexture(GLuint texture) {
+        for (size_t i = 0; i < framebuffers.size();) {
+            const CachedFramebuffer& cached = framebuffers[i];
+            bool uses = cached.depth == texture;
+            for (int c = 0; c < MAX_COLOR_ATTACHMENTS; c++) {
+                uses = uses || cached.colors[c] == texture;
+            }
+
+            if (uses) {
+                glDeleteFramebuffers(1, &framebuffers[i].fbo);
+                framebuffers[i] = framebuffers.back();
+                framebuffers.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+        glDeleteTextures(1, &texture);
+    }
+
+    GLenum textureTargetOf(GLuint texture) const {
+        for (const Entry& entry : entries) {
+            if (entry.texture == texture) return entry.samples > 1 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+        }
+        return GL_TEXTURE_2D;
+    }
+
+public:
+    RenderTargetPool() : frame(0), allocations(0) {}
+
+    // Evicts targets that no pass has asked for in a while
+    void beginFrame() {
+        frame++;
+        for (size_t i = 0; i < entries.size();) {
+            if (!entries[i].inUse && frame - entries[i].lastUsedFrame > EVICT_AFTER_FRAMES) {
+                destroyTexture(entries[i].texture);
+                entries[i] = entries.back();
+                entries.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+    }
+
+    // A texture of at least width x height; render with a width x height viewport
+    GLuint acquire(GLenum internalFormat, int width, int height, int samples = 1) {
+        int wantWidth = bucketSize(width);
+        int wantHeight = bucketSize(height);
+
+        // Smallest free target of this format that is large enough
+        Entry* best = NULL;
+        for (Entry& entry : entries) {
+            if (entry.inUse || entry.internalFormat != internalFormat || entry.samples != samples) continue;
+            if (entry.width < width || entry.height < height) continue;
+            if (!best || entry.width * entry.height < best->width * best->height) best = &entry;
+        }
+
+        if (best) {
+            if (best->width == wantWidth && best->height == wantHeight) {
+                best->oversizedUses = 0;
+            }
+            else if (++best->oversizedUses > SHRINK_AFTER_USES) {
+                destroyTexture(best->texture);
+                allocate(*best, wantWidth, wantHeight);
+            }
+        }
+        else {
+            Entry entry;
+            entry.internalFormat = internalFormat;
+            entry.samples = samples;
+            allocate(entry, wantWidth, wantHeight);
+            entries.push_back(entry);
+            best = &entries.back();
+        }
+
+        best->inUse = true;
+        best->lastUsedFrame = frame;
+        return best->texture;
+    }
+
+    void release(GLuint texture) {
+        for (Entry& entry : entries) {
+            if (entry.texture == texture) {
+                entry.inUse = false;
+                entry.lastUsedFrame = frame;
+                return;
+            }
+        }
+    }
+
+    // Framebuffer with the given attachments, or 0 if they are not complete
+    GLuint getFramebuffer(const GLuint* colors, int colorCount, GLuint depth) {
+        CachedFramebuffer key = {};
+        for (int c = 0; c < colorCount && c < MAX_COLOR_ATTACHMENTS; c++) {
+            key.colors[c] = colors[c];
+        }
+        key.depth = depth;
+
+        for (const CachedFramebuffer& cached : framebuffers) {
+            if (cached.depth == key.depth && std::equal(cached.colors, cached.colors + MAX_COLOR_ATTACHMENTS, key.colors)) {
+                return cached.fbo;
+            }
+        }
+
+        GLint oldFbo;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
+        glGenFramebuffers(1, &key.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, key.fbo);
+        for (int c = 0; c < MAX_COLOR_ATTACHMENTS; c++) {
+            if (key.colors[c]) {
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + c, textureTargetOf(key.colors[c]), key.colors[c], 0);
+            }
+        }
+        if (depth) {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textureTargetOf(depth), depth, 0);
+        }
+
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Pooled framebuffer is not complete! Status: " << status << std::endl;
+            glDeleteFramebuffers(1, &key.fbo);
+            return 0;
+        }
+
+        framebuffers.push_back(key);
+        return key.fbo;
+    }
+
+    // Allocated size of a pooled texture, which can exceed the size asked for
+    void getSize(GLuint texture, int& width, int& height) const {
+        width = height = 0;
+        for (const Entry& entry : entries) {
+            if (entry.texture == texture) {
+                width = entry.width;
+                height = entry.height;
+            }
+        }
+    }
+
+    int getTextureCount() const { return static_cast<int>(entries.size()); }
+    int getFramebufferCount() const { return static_cast<int>(framebuffers.size()); }
+    int getAllocationCount() const { return allocations; }
+
+    size_t getBytes() const {
+        size_t bytes = 0;
+        for (const Entry& entry : entries) {
+            bytes += size_t(entry.width) * entry.height * entry.samples * bytesPerPixel(entry.internalFormat);
+        }
+        return bytes;
+    }
+
+    void cleanup() {
+        for (const CachedFramebuffer& cached : framebuffers) {
+            glDeleteFramebuffers(1, &cached.fbo);
+        }
+        for (const Entry& entry : entries) {
+            glDeleteTextures(1, &entry.texture);
+        }
+        framebuffers.clear();
+        entries.clear();
+    }
+};
+
+// Offscreen targets for the lit pass: color plus a per-pixel object ID
+// written through MRT, sharing one depth buffer. Color is blitted to the
+// window each frame; the ID attachment is kept for picking until the
+// camera or the scene changes. The attachments come from the render-target
+// pool and are re-acquired every frame, so a resize only changes the
+// logical size and the pool decides whether the textures behind it change.
+// In MSAA mode the lit pass renders color only, into multisampled targets
+// that are resolved into the color attachment; picking then falls back to
+// the single-sampled ID pass.
+class FrameTargets {
+private:
+    RenderTargetPool& pool;
+    GLuint fbo;
+    GLuint colorTexture;
+    GLuint idTexture;
+    GLuint depthTexture;
+    GLuint multisampledFbo;
+    GLuint multisampledColor;
+    GLuint multisampledDepth;
+    int width, height;
+
+    bool idBufferValid;
+    uint64_t idSceneVersion;
+    uint64_t idCameraVersion;
+
+    void releaseAttachments() {
+        if (colorTexture) pool.release(colorTexture);
+        if (idTexture) pool.release(idTexture);
+        if (depthTexture) pool.release(depthTexture);
+        fbo = colorTexture = idTexture = depthTexture = 0;
+    }
+
+    void releaseMultisampled() {
+        if (multisampledColor) pool.release(multisampledColor);
+        if (multisampledDepth) pool.release(multisampledDepth);
+        multisampledFbo = multisampledColor = multisampledDepth = 0;
+    }
+
+    static void clearColorAndDepth() {
+        float background[] = { 0.1f, 0.1f, 0.1f, 1.0f };
+        glClearBufferfv(GL_COLOR, 0, background);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+public:
+    explicit FrameTargets(RenderTargetPool& pool) : pool(pool), fbo(0), colorTexture(0), idTexture(0), depthTexture(0),
+        multisampledFbo(0), multisampledColor(0), multisampledDepth(0), width(0), height(0),
+        idBufferValid(false), idSceneVersion(0), idCameraVersion(0) {}
+
+    void resize(int w, int h) {
+        if (w == width && h == height) return;
+        width = w;
+        height = h;
+        idBufferValid = false;
+    }
+
+    // Takes this frame's attachments from the pool; false if there is no usable framebuffer
+    bool acquire() {
+        releaseAttachments();
+        if (width <= 0 || height <= 0) return false;
+
+        colorTexture = pool.acquire(GL_RGBA8, width, height);
+        idTexture = pool.acquire(GL_RG32UI, width, height);
+        depthTexture = pool.acquire(GL_DEPTH_COMPONENT24, width, height);
+
+        GLuint colors[] = { colorTexture, idTexture };
+        fbo = pool.getFramebuffer(colors, 2, depthTexture);
+        if (!fbo) {
+            releaseAttachments();
+            return false;
+        }
+        return true;
+    }
+
+    bool isComplete() const { return fbo != 0; }
+    GLuint getFramebuffer() const { return fbo; }
+    GLuint getColorTexture() const { return colorTexture; }
+    GLuint getDepthTexture() const { return depthTexture; }
+
+    void bindForLitPass() {
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, width, height);
+        GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, drawBuffers);
+
+        GLuint noObject[] = { 0, 0, 0, 0 };
+        clearColorAndDepth();
+        glClearBufferuiv(GL_COLOR, 1, noObject);
+    }
+
+    // Color and depth only, for the jittered TAA pass: its IDs would be
+    // shifted by the jitter, so the ID attachment goes stale
+    void bindForColorPass() {
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, width, height);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        clearColorAndDepth();
+        idBufferValid = false;
+    }
+
+    // Binds multisampled color and depth for the lit pass. The fragment ID
+    // output has no draw buffer here, so the ID attachment goes stale.
+    bool bindForMultisampledPass(int samples) {
+        multisampledColor = pool.acquire(GL_RGBA8, width, height, samples);
+        multisampledDepth = pool.acquire(GL_DEPTH_COMPONENT24, width, height, samples);
+        multisampledFbo = pool.getFramebuffer(&multisampledColor, 1, multisampledDepth);
+        if (!multisampledFbo) {
+            releaseMultisampled();
+            return false;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, multisampledFbo);
+        glViewport(0, 0, width, height);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        clearColorAndDepth();
+        idBufferValid = false;
+        return true;
+    }
+
+    // Averages the samples into the color attachment. The multisampled
+    // targets go back to the pool right away.
+    void resolveMultisampled() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, multisampledFbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        releaseMultisampled();
+    }
+
+    void blitToWindow() {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void markIdBufferRendered(uint64_t sceneVersion, uint64_t cameraVersion) {
+        idBufferValid = true;
+        idSceneVersion = sceneVersion;
+        idCameraVersion = cameraVersion;
+    }
+
+    bool isIdBufferCurrent(uint64_t sceneVersion, uint64_t cameraVersion) const {
+        return idBufferValid && idSceneVersion == sceneVersion && idCameraVersion == cameraVersion;
+    }
+
+    void cleanup() {
+        releaseMultisampled();
+        releaseAttachments();
+        idBufferValid = false;
+    }
+};
+
+const char* fullscreenVertexShader = R"(
+#version 150 compatibility
+void main() {
+    gl_Position = gl_Vertex;
+}
+)";
+
+// FXAA: blur along the local edge direction, sampled bilinearly
+const char* fxaaFragmentShader = R"(
+#version 150 compatibility
+uniform sampler2D colorTexture;
+uniform vec2 texelSize;
+out vec4 fragColor;
+
+const float SPAN_MAX = 8.0;
+const float REDUCE_MUL = 1.0 / 8.0;
+const float REDUCE_MIN = 1.0 / 128.0;
+
+float luma(vec3 c) {
+    return dot(c, vec3(0.299, 0.587, 0.114));
+}
+
+vec3 sampleColor(vec2 uv) {
+    return texture(colorTexture, uv).rgb;
+}
+
+void main() {
+    vec2 uv = gl_FragCoord.xy * texelSize;
+    float lumaNW = luma(sampleColor(uv + vec2(-1.0, 1.0) * texelSize));
+    float lumaNE = luma(sampleColor(uv + vec2(1.0, 1.0) * texelSize));
+    float lumaSW = luma(sampleColor(uv + vec2(-1.0, -1.0) * texelSize));
+    float lumaSE = luma(sampleColor(uv + vec2(1.0, -1.0) * texelSize));
+    float lumaM = luma(sampleColor(uv));
+    float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+    float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+
+    // The edge runs perpendicular to the luma gradient
+    float gradientX = (lumaNE + lumaSE) - (lumaNW + lumaSW);
+    float gradientY = (lumaNW + lumaNE) - (lumaSW + lumaSE);
+    vec2 dir = vec2(-gradientY, gradientX);
+
+    float dirReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * REDUCE_MUL, REDUCE_MIN);
+    float rcpDirMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + dirReduce);
+    dir = clamp(dir * rcpDirMin, -SPAN_MAX, SPAN_MAX) * texelSize;
+
+    vec3 rgbA = 0.5 * (sampleColor(uv + dir * (1.0 / 3.0 - 0.5)) + sampleColor(uv + dir * (2.0 / 3.0 - 0.5)));
+    vec3 rgbB = rgbA * 0.5 + 0.25 * (sampleColor(uv - dir * 0.5) + sampleColor(uv + dir * 0.5));
+    float lumaB = luma(rgbB);
+    fragColor = vec4((lumaB < lumaMin || lumaB > lumaMax) ? rgbA : rgbB, 1.0);
+}
+)";
+
+// SMAA 1x, pass 1: color edges with each pixel's left (r) and bottom (g)
+// neighbour. Color rather than luma detection, since the saturated objects
+// here are close in luma to the dark background.
+const char* smaaEdgeFragmentShader = R"(
+#version 150 compatibility
+uniform sampler2D colorTexture;
+uniform ivec2 viewportSize;
+out vec4 edges;
+
+const float THRESHOLD = 0.05;
+const float CONTRAST_ADAPTATION = 2.0;
+
+vec3 colorAt(ivec2 p) {
+    return texelFetch(colorTexture, clamp(p, ivec2(0), viewportSize - 1), 0).rgb;
+}
+
+float delta(vec3 a, vec3 b) {
+    vec3 d = abs(a - b);
+    return max(max(d.r, d.g), d.b);
+}
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec3 c = colorAt(p);
+    vec3 left = colorAt(p + ivec2(-1, 0));
+    vec3 bottom = colorAt(p + ivec2(0, -1));
+    float deltaLeft = delta(c, left);
+    float deltaBottom = delta(c, bottom);
+    vec2 e = step(THRESHOLD, vec2(deltaLeft, deltaBottom));
+    if (e.x + e.y == 0.0) discard;
+
+    // Local contrast adaptation: drop edges that are much weaker than a neighbouring one
+    float deltaRight = delta(c, colorAt(p + ivec2(1, 0)));
+    float deltaTop = delta(c, colorAt(p + ivec2(0, 1)));
+    float deltaLeftLeft = delta(left, colorAt(p + ivec2(-2, 0)));
+    float deltaBottomBottom = delta(bottom, colorAt(p + ivec2(0, -2)));
+    float maxDelta = max(max(max(deltaLeft, deltaBottom), max(deltaRight, deltaTop)),
+        max(deltaLeftLeft, deltaBottomBottom));
+    e *= step(maxDelta, CONTRAST_ADAPTATION * vec2(deltaLeft, deltaBottom));
+    edges = vec4(e, 0.0, 0.0);
+}
+)";
+
+// SMAA 1x, pass 2: blend weights. Each edge is followed to both ends; the
+// crossing edges there decide whether the real silhouette bends up, down
+// or not at all, and the area between that silhouette and the pixel edge
+// is computed analytically instead of being looked up in an area texture.
+//   r: this pixel takes from the one below    g: the one below takes from this
+//   b: this pixel takes from the one on the left    a: the left one takes from this
+const char* smaaWeightFragmentShader = R"(
+#version 150 compatibility
+uniform sampler2D edgeTexture;
+uniform ivec2 viewportSize;
+out vec4 weights;
+
+const int MAX_SEARCH = 16;
+
+vec2 edgeAt(ivec2 p) {
+    if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, viewportSize))) return vec2(0.0);
+    return texelFetch(edgeTexture, p, 0).rg;
+}
+
+// Silhouette height at an end of the edge: +-0.5 when a crossing edge on
+// exactly one side turns it towards that side, 0 otherwise
+float crossingHeight(float positiveSide, float negativeSide) {
+    if (positiveSide > 0.5 && negativeSide < 0.5) return 0.5;
+    if (negativeSide > 0.5 && positiveSide < 0.5) return -0.5;
+    return 0.0;
+}
+
+// Heights at both ends with the same sign form a U, two L shapes that meet
+// halfway; anything else is a straight line between the ends
+float heightAt(float t, float startHeight, float endHeight) {
+    if (startHeight * endHeight > 0.0) return startHeight * abs(1.0 - 2.0 * t);
+    return mix(startHeight, endHeight, t);
+}
+
+// Area on the positive and on the negative side between the edge and a
+// silhouette segment running from height a to height b over the given width
+vec2 segmentArea(float a, float b, float width) {
+    vec2 area = vec2(0.0);
+    if (a * b >= 0.0) {
+        float signedArea = (a + b) * 0.5 * width;
+        return signedArea >= 0.0 ? vec2(signedArea, 0.0) : vec2(0.0, -signedArea);
+    }
+    float s = a / (a - b);
+    float first = a * s * 0.5 * width;
+    float second = b * (1.0 - s) * 0.5 * width;
+    area += first > 0.0 ? vec2(first, 0.0) : vec2(0.0, -first);
+    area += second > 0.0 ? vec2(second, 0.0) : vec2(0.0, -second);
+    return area;
+}
+
+// Coverage for the pixel at position 'offset' of an edge 'length' pixels long
+vec2 pixelArea(int offset, int length, float startHeight, float endHeight) {
+    float t0 = float(offset) / float(length);
+    float t1 = float(offset + 1) / float(length);
+    float a = heightAt(t0, startHeight, endHeight);
+    float b = heightAt(t1, startHeight, endHeight);
+
+    if (startHeight * endHeight > 0.0 && t0 < 0.5 && t1 > 0.5) {
+        float k = (0.5 - t0) / (t1 - t0);
+        return segmentArea(a, 0.0, k) + segmentArea(0.0, b, 1.0 - k);
+    }
+    return segmentArea(a, b, 1.0);
+}
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec2 e = edgeAt(p);
+    weights = vec4(0.0);
+
+    // Horizontal edge on the bottom of this pixel
+    if (e.g > 0.5) {
+        int left = 0;
+        while (left < MAX_SEARCH && edgeAt(p - ivec2(left + 1, 0)).g > 0.5) left++;
+        int right = 0;
+        while (right < MAX_SEARCH && edgeAt(p + ivec2(right + 1, 0)).g > 0.5) right++;
+
+        ivec2 first = p - ivec2(left, 0);
+        ivec2 after = p + ivec2(right + 1, 0);
+        float startHeight = left < MAX_SEARCH ? crossingHeight(edgeAt(first).r, edgeAt(first - ivec2(0, 1)).r) : 0.0;
+        float endHeight = right < MAX_SEARCH ? crossingHeight(edgeAt(after).r, edgeAt(after - ivec2(0, 1)).r) : 0.0;
+        weights.rg = pixelArea(left, left + right + 1, startHeight, endHeight);
+    }
+
+    // Vertical edge on the left of this pixel
+    if (e.r > 0.5) {
+        int down = 0;
+        while (down < MAX_SEARCH && edgeAt(p - ivec2(0, down + 1)).r > 0.5) down++;
+        int up = 0;
+        while (up < MAX_SEARCH && edgeAt(p + ivec2(0, up + 1)).r > 0.5) up++;
+
+        ivec2 first = p - ivec2(0, down);
+        ivec2 after = p + ivec2(0, up + 1);
+        float startHeight = down < MAX_SEARCH ? crossingHeight(edgeAt(first).g, edgeAt(first - ivec2(1, 0)).g) : 0.0;
+        float endHeight = up < MAX_SEARCH ? crossingHeight(edgeAt(after).g, edgeAt(after - ivec2(1, 0)).g) : 0.0;
+        weights.ba = pixelArea(down, down + up + 1, startHeight, endHeight);
+    }
+
+    if (weights == vec4(0.0)) discard;
+}
+)";
+
+// SMAA 1x, pass 3: blend each pixel with the neighbours its edges point to
+const char* smaaBlendFragmentShader = R"(
+#version 150 compatibility
+uniform sampler2D colorTexture;
+uniform sampler2D weightTexture;
+uniform ivec2 viewportSize;
+out vec4 fragColor;
+
+vec4 weightAt(ivec2 p) {
+    if (any(greaterThanEqual(p, viewportSize))) return vec4(0.0);
+    return texelFetch(weightTexture, p, 0);
+}
+
+vec3 colorAt(ivec2 p) {
+    return texelFetch(colorTexture, clamp(p, ivec2(0), viewportSize - 1), 0).rgb;
+}
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec4 own = weightAt(p);
+    float fromBelow = own.r;
+    float fromLeft = own.b;
+    float fromAbove = weightAt(p + ivec2(0, 1)).g;
+    float fromRight = weightAt(p + ivec2(1, 0)).a;
+    float total = fromBelow + fromAbove + fromLeft + fromRight;
+
+    vec3 color = colorAt(p);
+    if (total > 0.0) {
+        vec3 neighbours = fromBelow * colorAt(p - ivec2(0, 1)) + fromAbove * colorAt(p + ivec2(0, 1))
+            + fromLeft * colorAt(p - ivec2(1, 0)) + fromRight * colorAt(p + ivec2(1, 0));
+        float scale = total > 1.0 ? 1.0 / total : 1.0;
+        color = color * (1.0 - total * scale) + neighbours * scale;
+    }
+    fragColor = vec4(color, 1.0);
+}
+)";
+
+// Single-sample post-process anti-aliasing of the lit pass's color
+// attachment, drawn straight into the window: FXAA in one pass, or SMAA 1x
+// as edge detection, blend weights and neighbourhood blending through
+// transient pool targets. Every pass has its own GPU timer.
+class PostAntiAliasing {
+public:
+    enum Pass { PASS_FXAA, PASS_SMAA_EDGES, PASS_SMAA_WEIGHTS, PASS_SMAA_BLEND, PASS_COUNT };
+
+private:
+    RenderTargetPool& pool;
+    GLuint fxaaProgram, edgeProgram, weightProgram, blendProgram;
+    GLint fxaaTexelSizeLocation, edgeSizeLocation, weightSizeLocation, blendSizeLocation;
+    GLuint linearSampler;
+    GpuTimer timers[PASS_COUNT];
+
+    static GLuint createPass(const char* fragmentSource, const char* output) {
+        std::vector<const char*> outputs = { output };
+        return createProgram(fullscreenVertexShader, fragmentSource, outputs);
+    }
+
+    static void bindSamplers(GLuint program, const char* first, const char* second) {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, first), 0);
+        if (second) glUniform1i(glGetUniformLocation(program, second), 1);
+        glUseProgram(0);
+    }
+
+    static void drawFullscreenQuad() {
+        glBegin(GL_QUADS);
+        glVertex2f(-1.0f, -1.0f);
+        glVertex2f(1.0f, -1.0f);
+        glVertex2f(1.0f, 1.0f);
+        glVertex2f(-1.0f, 1.0f);
+        glEnd();
+    }
+
+    // Binds a pooled target for an intermediate pass and clears it to zero
+    bool bindIntermediate(GLuint texture, int width, int height) {
+        GLuint fbo = pool.getFramebuffer(&texture, 1, 0);
+        if (!fbo) return false;
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        glViewport(0, 0, width, height);
+        float zero[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        glClearBufferfv(GL_COLOR, 0, zero);
+        return true;
+    }
+
+    static void beginPasses() {
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_LIGHTING);
+    }
+
+    static void endPasses(int width, int height) {
+        glUseProgram(0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        glEnable(GL_DEPTH_TEST);
+    }
+
+public:
+    explicit PostAntiAliasing(RenderTargetPool& pool) : pool(pool), fxaaProgram(0), edgeProgram(0), weightProgram(0),
+        blendProgram(0), fxaaTexelSizeLocation(-1), edgeSizeLocation(-1), weightSizeLocation(-1), blendSizeLocation(-1),
+        linearSampler(0) {}
+
+    bool initialize() {
+        fxaaProgram = createPass(fxaaFragmentShader, "fragColor");
+        edgeProgram = createPass(smaaEdgeFragmentShader, "edges");
+        weightProgram = createPass(smaaWeightFragmentShader, "weights");
+        blendProgram = createPass(smaaBlendFragmentShader, "fragColor");
+        if (!fxaaProgram || !edgeProgram || !weightProgram || !blendProgram) {
+            cleanup();
+            return false;
+        }
+
+        bindSamplers(fxaaProgram, "colorTexture", NULL);
+        bindSamplers(edgeProgram, "colorTexture", NULL);
+        bindSamplers(weightProgram, "edgeTexture", NULL);
+        bindSamplers(blendProgram, "colorTexture", "weightTexture");
+        fxaaTexelSizeLocation = glGetUniformLocation(fxaaProgram, "texelSize");
+        edgeSizeLocation = glGetUniformLocation(edgeProgram, "viewportSize");
+        weightSizeLocation = glGetUniformLocation(weightProgram, "viewportSize");
+        blendSizeLocation = glGetUniformLocation(blendProgram, "viewportSize");
+
+        // FXAA needs bilinear taps; pooled textures stay nearest-filtered
+        glGenSamplers(1, &linearSampler);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        for (int pass = 0; pass < PASS_COUNT; pass++) {
+            timers[pass].initialize();
+        }
+        return true;
+    }
+
+    bool isAvailable() const { return fxaaProgram != 0; }
+
+    void applyFxaa(GLuint colorTexture, int width, int height) {
+        int textureWidth, textureHeight;
+        pool.getSize(colorTexture, textureWidth, textureHeight);
+
+        beginPasses();
+        timers[PASS_FXAA].begin();
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        glUseProgram(fxaaProgram);
+        glUniform2f(fxaaTexelSizeLocation, 1.0f / textureWidth, 1.0f / textureHeight);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glBindSampler(0, linearSampler);
+        drawFullscreenQuad();
+        glBindSampler(0, 0);
+        timers[PASS_FXAA].end();
+        endPasses(width, height);
+    }
+
+    void applySmaa(GLuint colorTexture, int width, int height) {
+        beginPasses();
+        glActiveTexture(GL_TEXTURE0);
+
+        GLuint edges = pool.acquire(GL_RGBA8, width, height);
+        timers[PASS_SMAA_EDGES].begin();
+        if (bindIntermediate(edges, width, height)) {
+            glUseProgram(edgeProgram);
+            glUniform2i(edgeSizeLocation, width, height);
+            glBindTexture(GL_TEXTURE_2D, colorTexture);
+            drawFullscreenQuad();
+        }
+        timers[PASS_SMAA_EDGES].end();
+
+        GLuint weights = pool.acquire(GL_RGBA8, width, height);
+        timers[PASS_SMAA_WEIGHTS].begin();
+        if (bindIntermediate(weights, width, height)) {
+            glUseProgram(weightProgram);
+            glUniform2i(weightSizeLocation, width, height);
+            glBindTexture(GL_TEXTURE_2D, edges);
+            drawFullscreenQuad();
+        }
+        timers[PASS_SMAA_WEIGHTS].end();
+        pool.release(edges);
+
+        timers[PASS_SMAA_BLEND].begin();
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        glUseProgram(blendProgram);
+        glUniform2i(blendSizeLocation, width, height);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, weights);
+        drawFullscreenQuad();
+        timers[PASS_SMAA_BLEND].end();
+        pool.release(weights);
+
+        endPasses(width, height);
+    }
+
+    double getPassMs(Pass pass) const { return timers[pass].getMs(); }
+
+    void cleanup() {
+        if (fxaaProgram) glDeleteProgram(fxaaProgram);
+        if (edgeProgram) glDeleteProgram(edgeProgram);
+        if (weightProgram) glDeleteProgram(weightProgram);
+        if (blendProgram) glDeleteProgram(blendProgram);
+        if (linearSampler) glDeleteSamplers(1, &linearSampler);
+        fxaaProgram = edgeProgram = weightProgram = blendProgram = linearSampler = 0;
+        for (int pass = 0; pass < PASS_COUNT; pass++) {
+            timers[pass].cleanup();
+        }
+    }
+};
+
+// TAA resolve: blends the current jittered frame into the reprojected history
+const char* taaFragmentShader = R"(
+#version 150 compatibility
+uniform sampler2D colorTexture;
+uniform sampler2D depthTexture;
+uniform sampler2D historyTexture;
+uniform mat4 currentToPrevious;
+uniform vec2 historyScale;
+uniform ivec2 viewportSize;
+uniform float blendWeight;
+out vec4 fragColor;
+
+vec3 colorAt(ivec2 p) {
+    return texelFetch(colorTexture, clamp(p, ivec2(0), viewportSize - 1), 0).rgb;
+}
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec3 current = colorAt(p);
+    if (blendWeight >= 1.0) {
+        fragColor = vec4(current, 1.0);
+        return;
+    }
+
+    // Where this pixel's surface was on screen last frame
+    vec2 uv = gl_FragCoord.xy / vec2(viewportSize);
+    float depth = texelFetch(depthTexture, p, 0).r;
+    vec4 previous = currentToPrevious * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec2 previousUv = previous.xy / previous.w * 0.5 + 0.5;
+    if (any(lessThan(previousUv, vec2(0.0))) || any(greaterThan(previousUv, vec2(1.0)))) {
+        fragColor = vec4(current, 1.0);
+        return;
+    }
+
+    // Clamp the history to the colors around this pixel now, so stale
+    // samples from disocclusions or recolored objects cannot ghost
+    vec3 minColor = current;
+    vec3 maxColor = current;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            vec3 c = colorAt(p + ivec2(x, y));
+            minColor = min(minColor, c);
+            maxColor = max(maxColor, c);
+        }
+    }
+
+    vec3 history = clamp(texture(historyTexture, previousUv * historyScale).rgb, minColor, maxColor);
+    fragColor = vec4(mix(history, current, blendWeight), 1.0);
+}
+)";
+
+// Temporal anti-aliasing. The projection is offset by a Halton(2, 3)
+// subpixel jitter every frame and each frame is blended into a history
+// buffer, reprojected through the depth buffer and last frame's
+// view-projection. While the scene and camera stay put the blend weight
+// falls as 1/n, so an idle view converges to a supersampled image over
+// MAX_SAMPLES frames; once the view moves the history keeps only the
+// weight of MOTION_SAMPLES frames.
+class TemporalAA {
+public:
+    static const int JITTER_PHASES = 16;
+    static const int MAX_SAMPLES = 32;
+    static const int MOTION_SAMPLES = 9;
+
+private:
+    RenderTargetPool& pool;
+    GLuint program;
+    GLint currentToPreviousLocation, historyScaleLocation, viewportSizeLocation, blendWeightLocation;
+    GLuint linearSampler;
+    GpuTimer timer;
+
+    GLuint history[2];
+    int historyWidth, historyHeight;
+    int current;  // history written by the last resolve
+    bool historyValid;
+    int samples;  // frames the history is worth
+    int frameIndex;
+    uint64_t sceneVersion, cameraVersion;
+    Matrix4 previousViewProjection;
+
+    static float halton(int index, int base) {
+        float f = 1.0f, result = 0.0f;
+        while (index > 0) {
+            f /= base;
+            result += f * (index % base);
+            index /= base;
+        }
+        return result;
+    }
+
+    // History textures are held across frames, so they are only swapped
+    // for new pool targets when the window size changes
+    void ensureHistory(int width, int height) {
+        if (history[0] && width == historyWidth && height == historyHeight) return;
+        releaseHistory();
+        history[0] = pool.acquire(GL_RGBA16F, width, height);
+        history[1] = pool.acquire(GL_RGBA16F, width, height);
+        historyWidth = width;
+        historyHeight = height;
+    }
+
+public:
+    explicit TemporalAA(RenderTargetPool& pool) : pool(pool), program(0), currentToPreviousLocation(-1),
+        historyScaleLocation(-1), viewportSizeLocation(-1), blendWeightLocation(-1), linearSampler(0),
+        historyWidth(0), historyHeight(0), current(0), historyValid(false), samples(0), frameIndex(0),
+        sceneVersion(0), cameraVersion(0) {
+        history[0] = history[1] = 0;
+    }
+
+    bool initialize() {
+        std::vector<const char*> outputs = { "fragColor" };
+        program = createProgram(fullscreenVertexShader, taaFragmentShader, outputs);
+        if (!program) return false;
+
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "colorTexture"), 0);
+        glUniform1i(glGetUniformLocation(program, "depthTexture"), 1);
+        glUniform1i(glGetUniformLocation(program, "historyTexture"), 2);
+        glUseProgram(0);
+        currentToPreviousLocation = glGetUniformLocation(program, "currentToPrevious");
+        historyScaleLocation = glGetUniformLocation(program, "historyScale");
+        viewportSizeLocation = glGetUniformLocation(program, "viewportSize");
+        blendWeightLocation = glGetUniformLocation(program, "blendWeight");
+
+        glGenSamplers(1, &linearSampler);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(linearSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        timer.initialize();
+        return true;
+    }
+
+    bool isAvailable() const { return program != 0; }
+
+    // This frame's projection, shifted by less than a pixel
+    Matrix4 jitter(const Matrix4& projection, int width, int height) const {
+        int phase = frameIndex % JITTER_PHASES + 1;
+        Matrix4 offset;
+        offset.m[12] = (halton(phase, 2) - 0.5f) * 2.0f / width;
+        offset.m[13] = (halton(phase, 3) - 0.5f) * 2.0f / height;
+        return offset * projection;
+    }
+
+    // Blends the frame rendered with jitter() into the history and shows the result
+    void resolve(GLuint colorTexture, GLuint depthTexture, int width, int height, const Matrix4& projection,
+        const Matrix4& view, uint64_t newSceneVersion, uint64_t newCameraVersion) {
+        ensureHistory(width, height);
+
+        if (!historyValid) {
+            samples = 0;
+        }
+        else if (newSceneVersion != sceneVersion || newCameraVersion != cameraVersion) {
+            samples = std::min(samples, MOTION_SAMPLES);
+        }
+
+        Matrix4 viewProjection = projection * view;
+        Matrix4 currentToPrevious = previousViewProjection * viewProjection.inverse();
+        int target = 1 - current;
+        int textureWidth, textureHeight;
+        pool.getSize(history[current], textureWidth, textureHeight);
+
+        GLuint fbo = pool.getFramebuffer(&history[target], 1, 0);
+        if (!fbo) return;
+
+        timer.begin();
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_LIGHTING);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        glViewport(0, 0, width, height);
+
+        glUseProgram(program);
+        glUniformMatrix4fv(currentToPreviousLocation, 1, GL_FALSE, currentToPrevious.m);
+        glUniform2f(historyScaleLocation, float(width) / textureWidth, float(height) / textureHeight);
+        glUniform2i(viewportSizeLocation, width, height);
+        glUniform1f(blendWeightLocation, 1.0f / (samples + 1));
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, history[current]);
+        glBindSampler(2, linearSampler);
+
+        glBegin(GL_QUADS);
+        glVertex2f(-1.0f, -1.0f);
+        glVertex2f(1.0f, -1.0f);
+        glVertex2f(1.0f, 1.0f);
+        glVertex2f(-1.0f, 1.0f);
+        glEnd();
+
+        glBindSampler(2, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glUseProgram(0);
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glEnable(GL_DEPTH_TEST);
+        timer.end();
+
+        current = target;
+        historyValid = true;
+        samples = std::min(samples + 1, MAX_SAMPLES);
+        frameIndex++;
+        sceneVersion = newSceneVersion;
+        cameraVersion = newCameraVersion;
+        previousViewProjection = viewProjection;
+    }
+
+    // Still accumulating towards a fully converged image
+    bool isConverging() const { return !historyValid || samples < MAX_SAMPLES; }
 
-        if (pickingMode) {
-            int r = (objectId & 0xFF0000) >> 16;
-            int g = (objectId & 0x00FF00) >> 8;
-            int b = (objectId & 0x0000FF);
+    void reset() { historyValid = false; }
 
-            glColor3ub(r, g, b);
-            glDisable(GL_LIGHTING);
+    // Gives the history textures back to the pool while TAA is off
+    void releaseHistory() {
+        for (int i = 0; i < 2; i++) {
+            if (history[i]) pool.release(history[i]);
+            history[i] = 0;
         }
-        else {
-            glEnable(GL_LIGHTING);
+        historyValid = false;
+    }
 
-            //    -   glMaterial
-            glDisable(GL_COLOR_MATERIAL);
+    int getSampleCount() const { return samples; }
+    double getResolveMs() const { return timer.getMs(); }
 
-            //     
-            float ambient[] = { diffuseColor.r * 0.3f, diffuseColor.g * 0.3f, diffuseColor.b * 0.3f, 1.0f };
-            float diffuse[] = { diffuseColor.r, diffuseColor.g, diffuseColor.b, 1.0f };
-            float specular[] = { 0.8f, 0.8f, 0.8f, 1.0f };
-            float shininess = 50.0f;
+    void cleanup() {
+        releaseHistory();
+        if (program) glDeleteProgram(program);
+        if (linearSampler) glDeleteSamplers(1, &linearSampler);
+        program = linearSampler = 0;
+        timer.cleanup();
+    }
+};
 
-            glMaterialfv(GL_FRONT, GL_AMBIENT, ambient);
-            glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
-            glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
-            glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+struct ScreenPoint {
+    float x, y;
+    ScreenPoint(float x = 0, float y = 0) : x(x), y(y) {}
+};
 
-            //  
-            std::cout << "Rendering object " << objectId << " with material - "
-                << "Ambient: " << ambient[0] << "," << ambient[1] << "," << ambient[2] << " | "
-                << "Diffuse: " << diffuse[0] << "," << diffuse[1] << "," << diffuse[2] << std::endl;
-        }
+// Rectangle (x0, y0)-(x1, y1) in GLUT window coordinates (y down). A
+// non-empty lasso restricts the selection to the polygon's interior.
+struct RegionQuery {
+    int x0, y0, x1, y1;
+    std::vector<ScreenPoint> lasso;
+    bool visibleOnly;  // IDs actually on screen, or every object inside the region's frustum
 
-        glBegin(GL_TRIANGLES);
-        for (size_t i = 0; i < indices.size(); i++) {
-            int vertexIndex = indices[i] % 8;
-            int normalIndex = indices[i] / 8 * 4 + (i % 6) / 3;
+    RegionQuery() : x0(0), y0(0), x1(0), y1(0), visibleOnly(true) {}
+};
 
-            if (!pickingMode) {
-                glNormal3f(normals[normalIndex].x, normals[normalIndex].y, normals[normalIndex].z);
-            }
-            glVertex3f(vertices[vertexIndex].x, vertices[vertexIndex].y, vertices[vertexIndex].z);
-        }
-        glEnd();
+struct RegionPickResult {
+    std::vector<int> objectIndices;
+    int pixelsScanned;
+    double scanMs;     // CPU time spent extracting the objects
+    double latencyMs;  // request to delivery
 
-        if (pickingMode) {
-            glEnable(GL_LIGHTING);
-        }
+    RegionPickResult() : pixelsScanned(0), scanMs(0.0), latencyMs(0.0) {}
+};
 
-        glPopMatrix();
-    }
+typedef std::function<void(const RegionPickResult&)> RegionPickCallback;
 
-    void setDiffuseColor(const Color& color) {
-        std::cout << "Changing object " << objectId << " color from "
-            << "R=" << diffuseColor.r << " G=" << diffuseColor.g << " B=" << diffuseColor.b
-            << " to R=" << color.r << " G=" << color.g << " B=" << color.b << std::endl;
-        diffuseColor = color;
+// Even-odd point in polygon test
+bool pointInPolygon(const std::vector<ScreenPoint>& polygon, float x, float y) {
+    bool inside = false;
+    for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+        const ScreenPoint& a = polygon[i];
+        const ScreenPoint& b = polygon[j];
+        if ((a.y > y) != (b.y > y) && x < (b.x - a.x) * (y - a.y) / (b.y - a.y) + a.x) {
+            inside = !inside;
+        }
     }
+    return inside;
+}
 
-    int getObjectId() const {
-        return objectId;
+// Rectangle and lasso selection. Visible-only queries read the region of the
+// lit pass's ID attachment back in one asynchronous transfer and collapse it
+// to unique objects: runs of equal IDs are skipped four pixels at a time with
+// SSE2, and a bitset over dense indices removes duplicates. Lasso queries
+// only scan the polygon's spans on each row. Frustum queries never touch the
+// GPU; they cull the BVH with the region's pick frustum instead.
+class RegionPicker {
+private:
+    GLuint pbo;
+    size_t pboSize;
+    GLsync fence;
+    RegionQuery query;
+    int readX, readY, readWidth, readHeight;  // GL window coordinates
+    int windowHeight;
+    RegionPickCallback callback;
+    std::chrono::high_resolution_clock::time_point requestTime;
+
+    std::vector<uint64_t> seen;
+    std::vector<float> crossings;
+    std::vector<uint32_t> candidates;
+
+    static void clampRegion(const RegionQuery& q, int windowWidth, int windowHeight, int& x, int& y, int& w, int& h) {
+        int left = std::max(std::min(q.x0, q.x1), 0);
+        int right = std::min(std::max(q.x0, q.x1), windowWidth - 1);
+        int top = std::max(std::min(q.y0, q.y1), 0);
+        int bottom = std::min(std::max(q.y0, q.y1), windowHeight - 1);
+
+        x = left;
+        y = windowHeight - 1 - bottom;
+        w = std::max(right - left + 1, 0);
+        h = std::max(bottom - top + 1, 0);
     }
 
-    Color getDiffuseColor() const {
-        return diffuseColor;
+    void resetSeen(size_t objectCount) {
+        seen.assign((objectCount + 63) / 64, 0);
     }
-};
 
-class PickingSystem {
-private:
-    GLuint fbo;
-    GLuint colorBuffer;
-    GLuint depthBuffer;
-    int windowWidth, windowHeight;
+    void addId(uint32_t id, const SceneStore& scene, RegionPickResult& result) {
+        if (id == 0) return;
+        int index = scene.findById(static_cast<int>(id));
+        if (index < 0) return;
 
-public:
-    PickingSystem() : fbo(0), colorBuffer(0), depthBuffer(0), windowWidth(800), windowHeight(600) {}
+        uint64_t bit = uint64_t(1) << (index & 63);
+        if (seen[index >> 6] & bit) return;
+        seen[index >> 6] |= bit;
+        result.objectIndices.push_back(index);
+    }
 
-    bool initialize() {
-        glGenFramebuffers(1, &fbo);
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    // Visits each run of equal IDs in a row span once
+    void scanSpan(const uint32_t* ids, int count, const SceneStore& scene, RegionPickResult& result) {
+        uint32_t lastId = 0;
+        int i = 0;
+#if defined(_M_X64) || defined(__SSE2__)
+        __m128i last = _mm_setzero_si128();
+        while (i + 4 <= count) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ids + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, last)) == 0xFFFF) {
+                i += 4;
+                continue;
+            }
+            for (int end = i + 4; i < end; i++) {
+                if (ids[i] != lastId) {
+                    lastId = ids[i];
+                    addId(lastId, scene, result);
+                }
+            }
+            last = _mm_set1_epi32(static_cast<int>(lastId));
+        }
+#endif
+        for (; i < count; i++) {
+            if (ids[i] != lastId) {
+                lastId = ids[i];
+                addId(lastId, scene, result);
+            }
+        }
+    }
 
-        // Color buffer
-        glGenTextures(1, &colorBuffer);
-        glBindTexture(GL_TEXTURE_2D, colorBuffer);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, windowWidth, windowHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorBuffer, 0);
+    void scanRegion(const uint32_t* ids, const SceneStore& scene, RegionPickResult& result) {
+        resetSeen(scene.size());
 
-        // Depth buffer
-        glGenRenderbuffers(1, &depthBuffer);
-        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, windowWidth, windowHeight);
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        for (int row = 0; row < readHeight; row++) {
+            const uint32_t* rowIds = ids + size_t(row) * readWidth;
 
-        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-        if (status != GL_FRAMEBUFFER_COMPLETE) {
-            std::cout << "Framebuffer is not complete! Status: " << status << std::endl;
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-            return false;
-        }
+            if (query.lasso.size() < 3) {
+                scanSpan(rowIds, readWidth, scene, result);
+                result.pixelsScanned += readWidth;
+                continue;
+            }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        std::cout << "FBO initialized successfully!" << std::endl;
-        return true;
+            // Where the lasso crosses this row's pixel centers (GLUT y down)
+            float y = float(windowHeight - 1 - (readY + row)) + 0.5f;
+            crossings.clear();
+            const std::vector<ScreenPoint>& polygon = query.lasso;
+            for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+                const ScreenPoint& a = polygon[i];
+                const ScreenPoint& b = polygon[j];
+                if ((a.y > y) != (b.y > y)) {
+                    crossings.push_back((b.x - a.x) * (y - a.y) / (b.y - a.y) + a.x);
+                }
+            }
+            std::sort(crossings.begin(), crossings.end());
+
+            for (size_t k = 0; k + 1 < crossings.size(); k += 2) {
+                int first = std::max(int(ceilf(crossings[k] - 0.5f)) - readX, 0);
+                int last = std::min(int(ceilf(crossings[k + 1] - 0.5f)) - readX, readWidth);
+                if (last > first) {
+                    scanSpan(rowIds + first, last - first, scene, result);
+                    result.pixelsScanned += last - first;
+                }
+            }
+        }
     }
 
-    int pickObject(int mouseX, int mouseY, const std::vector<MeshObject*>& objects) {
-        //   FBO
-        GLint oldFbo;
-        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &oldFbo);
-
-        //   FBO  
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+public:
+    RegionPicker() : pbo(0), pboSize(0), fence(0), readX(0), readY(0), readWidth(0), readHeight(0), windowHeight(0) {}
+
+    // Starts the readback of the query region from an ID attachment filled by
+    // the frame that was just rendered. Replaces any query still in flight.
+    void request(const RegionQuery& q, GLuint framebuffer, GLenum attachment, int windowWidth, int windowHeight,
+        const RegionPickCallback& onComplete) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = 0;
+        }
 
-        //    (ID = 0)
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        query = q;
+        callback = onComplete;
+        this->windowHeight = windowHeight;
+        clampRegion(q, windowWidth, windowHeight, readX, readY, readWidth, readHeight);
+        requestTime = std::chrono::high_resolution_clock::now();
+
+        size_t bytes = size_t(readWidth) * readHeight * sizeof(uint32_t);
+        if (!pbo) glGenBuffers(1, &pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        if (bytes > pboSize) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+            pboSize = bytes;
+        }
 
-        //  
-        glViewport(0, 0, windowWidth, windowHeight);
+        if (bytes > 0) {
+            GLint oldReadFbo;
+            glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &oldReadFbo);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+            glReadBuffer(attachment);
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            glReadPixels(readX, readY, readWidth, readHeight, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, oldReadFbo);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-        setupPickingView();
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+    }
 
-        //     
-        std::cout << "Rendering objects for picking:" << std::endl;
-        for (MeshObject* obj : objects) {
-            std::cout << "Object ID: " << obj->getObjectId() << std::endl;
-            obj->render(true);
+    // Delivers the pending query once its readback has landed; never blocks
+    void poll(const SceneStore& scene) {
+        if (!fence) return;
+
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+        glDeleteSync(fence);
+        fence = 0;
+
+        RegionPickResult result;
+        auto start = std::chrono::high_resolution_clock::now();
+
+        if (readWidth > 0 && readHeight > 0) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                size_t(readWidth) * readHeight * sizeof(uint32_t), GL_MAP_READ_BIT);
+            if (data) {
+                scanRegion(static_cast<const uint32_t*>(data), scene, result);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
         }
 
-        //  
-        unsigned char pixel[3];
-        glReadPixels(mouseX, windowHeight - mouseY - 1, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, pixel);
-
-        //   FBO
-        glBindFramebuffer(GL_FRAMEBUFFER, oldFbo);
-        glClearColor(0.1f, 0.1f, 0.1f, 1.0f); //   
+        auto end = std::chrono::high_resolution_clock::now();
+        result.scanMs = std::chrono::duration<double, std::milli>(end - start).count();
+        result.latencyMs = std::chrono::duration<double, std::milli>(end - requestTime).count();
 
-        //   ID
-        int clickedId = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+        RegionPickCallback onComplete;
+        onComplete.swap(callback);
+        if (onComplete) onComplete(result);
+    }
 
-        std::cout << "Mouse: " << mouseX << ", " << mouseY << " -> ID: " << clickedId
-            << " (R:" << (int)pixel[0] << " G:" << (int)pixel[1] << " B:" << (int)pixel[2] << ")" << std::endl;
+    bool hasPending() const {
+        return fence != 0;
+    }
 
-        //  
-        for (size_t i = 0; i < objects.size(); i++) {
-            if (objects[i]->getObjectId() == clickedId && clickedId != 0) {
-                std::cout << "Found object: " << i << std::endl;
-                return static_cast<int>(i);
+    // Every object whose bounds reach into the region's frustum, hidden or
+    // not. Lasso queries keep the objects whose projected center is inside.
+    void selectInFrustum(const RegionQuery& q, const SceneStore& scene, const Matrix4& projection, const Matrix4& view,
+        int windowWidth, int windowHeight, RegionPickResult& result) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        int x, y, w, h;
+        clampRegion(q, windowWidth, windowHeight, x, y, w, h);
+        if (w > 0 && h > 0) {
+            int viewport[4] = { 0, 0, windowWidth, windowHeight };
+            Matrix4 regionProjection = Matrix4::pickMatrix(x + w * 0.5f, y + h * 0.5f, float(w), float(h), viewport) * projection;
+            Frustum frustum(regionProjection * view);
+
+            CullingStats stats;
+            scene.cull(frustum, candidates, stats);
+
+            Matrix4 viewProjection = projection * view;
+            for (uint32_t index : candidates) {
+                // The tree stores fattened boxes; recheck with the exact one
+                if (frustum.classify(scene.getBounds(index)) == Frustum::OUTSIDE) continue;
+
+                if (q.lasso.size() >= 3) {
+                    Vertex ndc = viewProjection.transformPoint(scene.getPosition(index));
+                    float sx = (ndc.x * 0.5f + 0.5f) * windowWidth;
+                    float sy = (0.5f - ndc.y * 0.5f) * windowHeight;
+                    if (!pointInPolygon(q.lasso, sx, sy)) continue;
+                }
+                result.objectIndices.push_back(static_cast<int>(index));
             }
         }
 
-        std::cout << "No object found!" << std::endl;
-        return -1;
+        result.scanMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        result.latencyMs = result.scanMs;
     }
 
     void cleanup() {
-        if (fbo) glDeleteFramebuffers(1, &fbo);
-        if (colorBuffer) glDeleteTextures(1, &colorBuffer);
-        if (depthBuffer) glDeleteRenderbuffers(1, &depthBuffer);
+        if (fence) glDeleteSync(fence);
+        if (pbo) glDeleteBuffers(1, &pbo);
+        fence = 0;
+        pbo = 0;
+        pboSize = 0;
     }
+};
 
-    void setWindowSize(int width, int height) {
-        windowWidth = width;
-        windowHeight = height;
-        cleanup();
-        initialize();
+// Hover highlighting driven by asynchronous picks. Motion events only record
+// the cursor, so any number of them between two frames collapse into one.
+// Once per frame update() issues at most one pick, and only when the cursor,
+// the scene or the camera changed since the last query; the result arrives
+// on a later frame and moves the hover flag to the object under the cursor.
+class HoverPicker {
+private:
+    int cursorX, cursorY;
+    bool hasCursor;
+    bool inFlight;
+    bool queried;
+    int queriedX, queriedY;
+    uint64_t queriedSceneVersion, queriedCameraVersion;
+
+    ObjectHandle hovered;
+
+    double lastLatencyMs;
+    int picksInWindow;
+    double picksPerSecond;
+    std::chrono::high_resolution_clock::time_point windowStart;
+
+    void onPicked(SceneStore& scene, const PickResult& result) {
+        inFlight = false;
+        lastLatencyMs = result.latencyMs;
+        picksInWindow++;
+
+        int previous = scene.indexOf(hovered);
+        if (previous != -1) scene.setHovered(previous, false);
+
+        hovered = ObjectHandle();
+        if (result.objectIndex != -1) {
+            scene.setHovered(result.objectIndex, true);
+            hovered = scene.handleAt(result.objectIndex);
+        }
     }
 
-private:
-    void setupPickingView() {
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        gluPerspective(45.0f, float(windowWidth) / windowHeight, 0.1f, 100.0f);
+public:
+    HoverPicker() : cursorX(0), cursorY(0), hasCursor(false), inFlight(false), queried(false),
+        queriedX(0), queriedY(0), queriedSceneVersion(0), queriedCameraVersion(0),
+        lastLatencyMs(0.0), picksInWindow(0), picksPerSecond(0.0),
+        windowStart(std::chrono::high_resolution_clock::now()) {}
+
+    void setCursor(int x, int y) {
+        cursorX = x;
+        cursorY = y;
+        hasCursor = true;
+    }
 
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
+    bool needsQuery(uint64_t sceneVersion, uint64_t cameraVersion) const {
+        if (!hasCursor || inFlight) return false;
+        return !queried || cursorX != queriedX || cursorY != queriedY
+            || sceneVersion != queriedSceneVersion || cameraVersion != queriedCameraVersion;
+    }
 
-        float eyeX = 8.0f * cosf(45.0f * 3.14159f / 180.0f) * sinf(45.0f * 3.14159f / 180.0f);
-        float eyeY = 8.0f * cosf(45.0f * 3.14159f / 180.0f);
-        float eyeZ = 8.0f * sinf(45.0f * 3.14159f / 180.0f) * sinf(45.0f * 3.14159f / 180.0f);
+    // Reads the hovered ID from the lit pass's ID attachment when
+    // idFramebuffer is non-zero, otherwise renders a pick pass
+    void update(PickingSystem& picker, SceneStore& scene, GLuint idFramebuffer, uint64_t cameraVersion,
+        const Matrix4& projection, const Matrix4& view) {
+        auto now = std::chrono::high_resolution_clock::now();
+        double windowSeconds = std::chrono::duration<double>(now - windowStart).count();
+        if (windowSeconds >= 1.0) {
+            picksPerSecond = picksInWindow / windowSeconds;
+            picksInWindow = 0;
+            windowStart = now;
+        }
+
+        if (!needsQuery(scene.getVersion(), cameraVersion)) return;
 
-        gluLookAt(eyeX, eyeY, eyeZ, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+        queried = true;
+        queriedX = cursorX;
+        queriedY = cursorY;
+        queriedSceneVersion = scene.getVersion();
+        queriedCameraVersion = cameraVersion;
+        inFlight = true;
+
+        SceneStore* target = &scene;
+        PickCallback callback = [this, target](const PickResult& result) { onPicked(*target, result); };
+        if (idFramebuffer) {
+            picker.requestPickFromIdBuffer(cursorX, cursorY, idFramebuffer, GL_COLOR_ATTACHMENT1, scene,
+                projection, view, callback, true);
+        }
+        else {
+            picker.requestPick(cursorX, cursorY, scene, projection, view, callback, true);
+        }
     }
+
+    bool isPending() const { return inFlight; }
+    double getLatencyMs() const { return lastLatencyMs; }
+    double getPicksPerSecond() const { return picksPerSecond; }
 };
 
 class Camera {
 private:
     float cameraDistance;
     float cameraAngleX, cameraAngleY;
+    uint64_t version;  // bumped on every change, used to detect stale view-dependent caches
 
 public:
-    Camera() : cameraDistance(8.0f), cameraAngleX(45.0f), cameraAngleY(45.0f) {}
+    Camera() : cameraDistance(8.0f), cameraAngleX(45.0f), cameraAngleY(45.0f), version(0) {}
+
+    uint64_t getVersion() const { return version; }
 
     void apply() {
         glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        gluPerspective(45.0f, 800.0f / 600.0f, 0.1f, 100.0f);
+        glLoadMatrixf(getProjectionMatrix().m);
 
         glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
+        glLoadMatrixf(getViewMatrix().m);
+    }
+
+    Matrix4 getProjectionMatrix() const {
+        return Matrix4::perspective(45.0f, 800.0f / 600.0f, 0.1f, 100.0f);
+    }
 
+    Matrix4 getViewMatrix() const {
         float radX = cameraAngleX * 3.14159f / 180.0f;
         float radY = cameraAngleY * 3.14159f / 180.0f;
 
@@ -277,31 +3073,59 @@ public:
         float eyeY = cameraDistance * cosf(radX);
         float eyeZ = cameraDistance * sinf(radY) * sinf(radX);
 
-        gluLookAt(eyeX, eyeY, eyeZ, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+        return Matrix4::lookAt(Vertex(eyeX, eyeY, eyeZ), Vertex(0.0f, 0.0f, 0.0f), Vertex(0.0f, 1.0f, 0.0f));
     }
 
     void rotate(float dx, float dy) {
         cameraAngleX += dy;
         cameraAngleY += dx;
+        version++;
     }
 
     void zoom(float delta) {
         cameraDistance += delta;
         cameraDistance = std::max(1.0f, std::min(20.0f, cameraDistance));
+        version++;
     }
 
     void reset() {
         cameraDistance = 8.0f;
         cameraAngleX = 45.0f;
         cameraAngleY = 45.0f;
+        version++;
     }
 };
 
 // Global variables
-std::vector<MeshObject*> objects;
+enum PickMode { PICK_CPU, PICK_GPU };
+enum AntiAliasingMode { AA_OFF, AA_MSAA, AA_FXAA, AA_SMAA, AA_TAA, AA_MODE_COUNT };
+
+SceneStore scene;
+std::vector<ObjectHandle> spawnedObjects;
+std::vector<uint32_t> visibleObjects;
+CullingStats cullingStats;
+RenderQueue renderQueue;
+RenderQueueStats renderQueueStats;
 Camera camera;
 PickingSystem picker;
-bool antiAliasing = false;
+RenderTargetPool renderTargets;
+FrameTargets frameTargets(renderTargets);
+PostAntiAliasing postAntiAliasing(renderTargets);
+TemporalAA temporalAA(renderTargets);
+RegionPicker regionPicker;
+RegionQuery regionDrag;
+bool regionDragging = false;
+bool regionQueued = false;   // visible-only query waiting for the next lit pass
+bool regionVisibleOnly = true;
+RegionPickResult lastRegionResult;
+HoverPicker hoverPicker;
+GLuint litProgram = 0;
+GLint litObjectIdLocation = -1;
+AntiAliasingMode aaMode = AA_OFF;
+int msaaSamples = 4;
+int maxMsaaSamples = 0;
+GpuTimer aaTimers[AA_MODE_COUNT];  // GPU time of the lit pass plus MSAA resolve, per mode
+PickMode pickMode = PICK_CPU;
 int windowWidth = 800, windowHeight = 600;
 
 Color randomColor() {
@@ -340,28 +3164,229 @@ void setupLighting() {
 
 void initializeObjects() {
     //      
-    objects.push_back(new MeshObject(Vertex(-2.0f, 0.0f, 0.0f), Color(1.0f, 0.0f, 0.0f), 0xFF0000, 0.8f)); // 
-    objects.push_back(new MeshObject(Vertex(0.0f, 0.0f, 0.0f), Color(0.0f, 1.0f, 0.0f), 0x00FF00, 0.8f));  //   
-    objects.push_back(new MeshObject(Vertex(2.0f, 0.0f, 0.0f), Color(0.0f, 0.0f, 1.0f), 0x0000FF, 0.8f));  // 
+    scene.create(Vertex(-2.0f, 0.0f, 0.0f), Color(1.0f, 0.0f, 0.0f), 0xFF0000, 0.8f); // 
+    scene.create(Vertex(0.0f, 0.0f, 0.0f), Color(0.0f, 1.0f, 0.0f), 0x00FF00, 0.8f);  //   
+    scene.create(Vertex(2.0f, 0.0f, 0.0f), Color(0.0f, 0.0f, 1.0f), 0x0000FF, 0.8f);  // 
 
     std::cout << "Objects initialized:" << std::endl;
-    for (size_t i = 0; i < objects.size(); i++) {
-        Color objColor = objects[i]->getDiffuseColor();
-        std::cout << "Object " << i << " - ID: " << objects[i]->getObjectId()
+    for (size_t i = 0; i < scene.size(); i++) {
+        Color objColor = scene.getDiffuseColor(i);
+        std::cout << "Object " << i << " - ID: " << scene.getObjectId(i)
             << " Color: R=" << objColor.r << " G=" << objColor.g << " B=" << objColor.b << std::endl;
     }
 }
 
+int allocateObjectId() {
+    // IDs are written to a 32-bit ID target and must not be 0 (background)
+    static int nextId = 1;
+    while (scene.findById(nextId) != -1) {
+        nextId = (nextId % 0x7FFFFFFF) + 1;
+    }
+    int id = nextId;
+    nextId = (nextId % 0x7FFFFFFF) + 1;
+    return id;
+}
+
+// Stress helper: scatters a batch of small cubes around the initial objects
+void spawnObjectBatch(int count) {
+    scene.reserve(scene.size() + count);
+    spawnedObjects.reserve(spawnedObjects.size() + count);
+
+    for (int i = 0; i < count; i++) {
+        Vertex pos((rand() / float(RAND_MAX) - 0.5f) * 16.0f,
+            (rand() / float(RAND_MAX) - 0.5f) * 16.0f,
+            (rand() / float(RAND_MAX) - 0.5f) * 16.0f);
+        Color color(rand() / float(RAND_MAX), rand() / float(RAND_MAX), rand() / float(RAND_MAX));
+        spawnedObjects.push_back(scene.create(pos, color, allocateObjectId(), 0.1f));
+    }
+
+    std::cout << "Spawned " << count << " objects, total: " << scene.size() << std::endl;
+}
+
+void clearSpawnedObjects() {
+    for (const ObjectHandle& handle : spawnedObjects) {
+        scene.destroy(handle);
+    }
+    spawnedObjects.clear();
+
+    std::cout << "Spawned objects removed, total: " << scene.size() << std::endl;
+}
+
+void updateVisibleSet() {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    cullingStats = CullingStats();
+    Frustum frustum(camera.getProjectionMatrix() * camera.getViewMatrix());
+    scene.cull(frustum, visibleObjects, cullingStats);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    cullingStats.timeMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Emits the visible objects into the render queue, sorts them by state key
+// and submits them, reprogramming the material only when the state changes
+void drawLitPass() {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const float zNear = 0.1f, zFar = 100.0f;
+    Matrix4 view = camera.getViewMatrix();
+
+    renderQueue.clear();
+    for (uint32_t index : visibleObjects) {
+        const Vertex& p = scene.getPosition(index);
+        float depth = -(view.m[2] * p.x + view.m[6] * p.y + view.m[10] * p.z + view.m[14]);
+        float t = std::min(std::max((depth - zNear) / (zFar - zNear), 0.0f), 1.0f);
+        uint32_t depthBucket = static_cast<uint32_t>(t * 65535.0f);
+
+        renderQueue.push(RenderQueue::makeKey(RenderQueue::PASS_OPAQUE, 0, scene.getMaterialKey(index), depthBucket), index);
+    }
+    renderQueue.sort();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    renderQueueStats = RenderQueueStats();
+    renderQueueStats.sortMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+    glEnable(GL_LIGHTING);
+    glDisable(GL_COLOR_MATERIAL);
+    if (litProgram) glUseProgram(litProgram);
+
+    const std::vector<RenderQueue::DrawItem>& items = renderQueue.getItems();
+    uint64_t currentState = ~0ull;
+    for (const RenderQueue::DrawItem& item : items) {
+        uint64_t state = RenderQueue::stateOf(item.key);
+        if (state != currentState) {
+            scene.applyMaterial(item.index);
+            currentState = state;
+            renderQueueStats.stateChanges++;
+        }
+        if (litProgram) {
+            glUniform1ui(litObjectIdLocation, static_cast<GLuint>(scene.getObjectId(item.index)));
+        }
+        scene.drawGeometry(item.index, false);
+    }
+    renderQueueStats.items = static_cast<int>(items.size());
+
+    if (litProgram) glUseProgram(0);
+}
+
+std::string antiAliasingName(AntiAliasingMode mode) {
+    switch (mode) {
+    case AA_MSAA: return "MSAA " + std::to_string(msaaSamples) + "x";
+    case AA_FXAA: return "FXAA";
+    case AA_SMAA: return "SMAA 1x";
+    case AA_TAA: return "TAA";
+    default: return "OFF";
+    }
+}
+
+void drawOverlayLine(float x, float y, const std::string& text) {
+    glRasterPos2f(x, y);
+    for (char c : text) {
+        glutBitmapCharacter(GLUT_BITMAP_9_BY_15, c);
+    }
+}
+
+void onRegionSelected(const RegionPickResult& result) {
+    scene.clearSelection();
+    for (int index : result.objectIndices) {
+        scene.setSelected(index, true);
+    }
+    lastRegionResult = result;
+
+    std::cout << "Selected " << result.objectIndices.size() << " objects (" << result.pixelsScanned
+        << " pixels scanned in " << result.scanMs << " ms, " << result.latencyMs << " ms total)" << std::endl;
+    glutPostRedisplay();
+}
+
+void drawRegionOutline() {
+    glBegin(GL_LINE_LOOP);
+    if (regionDrag.lasso.empty()) {
+        glVertex2f(float(regionDrag.x0), float(regionDrag.y0));
+        glVertex2f(float(regionDrag.x1), float(regionDrag.y0));
+        glVertex2f(float(regionDrag.x1), float(regionDrag.y1));
+        glVertex2f(float(regionDrag.x0), float(regionDrag.y1));
+    }
+    else {
+        for (const ScreenPoint& p : regionDrag.lasso) {
+            glVertex2f(p.x, p.y);
+        }
+    }
+    glEnd();
+}
+
 void display() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    picker.pollPicks(scene);
+    regionPicker.poll(scene);
+    renderTargets.beginFrame();
+
+    // With MRT the lit pass also leaves an ID buffer behind for picking,
+    // except in MSAA mode, where only color is multisampled, and in TAA
+    // mode, where the pass is jittered
+    bool useFrameTargets = litProgram != 0 && frameTargets.acquire();
+    bool useMultisampling = useFrameTargets && aaMode == AA_MSAA
+        && frameTargets.bindForMultisampledPass(msaaSamples);
+    bool usePostProcess = useFrameTargets && (aaMode == AA_FXAA || aaMode == AA_SMAA);
+    bool useTemporal = useFrameTargets && aaMode == AA_TAA;
+    bool writesIdBuffer = useFrameTargets && !useMultisampling && !useTemporal;
+
+    GpuTimer& frameTimer = aaTimers[useMultisampling || usePostProcess || useTemporal ? aaMode : AA_OFF];
+    frameTimer.begin();
+
+    if (writesIdBuffer) {
+        frameTargets.bindForLitPass();
+    }
+    else if (useTemporal) {
+        frameTargets.bindForColorPass();
+    }
+    else if (!useFrameTargets) {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
 
     camera.apply();
+    if (useTemporal) {
+        // Only the lit pass is jittered; culling keeps the real projection, and
+        // picks render their own unjittered ID pass
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixf(temporalAA.jitter(camera.getProjectionMatrix(), windowWidth, windowHeight).m);
+        glMatrixMode(GL_MODELVIEW);
+    }
     setupLighting();
+    updateVisibleSet();
+    drawLitPass();
 
+    if (useMultisampling) {
+        frameTargets.resolveMultisampled();
+    }
+    frameTimer.end();
+
+    if (writesIdBuffer) {
+        frameTargets.markIdBufferRendered(scene.getVersion(), camera.getVersion());
+
+        // The ID attachment now matches what is on screen
+        if (regionQueued) {
+            regionPicker.request(regionDrag, frameTargets.getFramebuffer(), GL_COLOR_ATTACHMENT1,
+                windowWidth, windowHeight, onRegionSelected);
+            regionQueued = false;
+        }
+    }
 
+    // At most one hover query per frame, issued while the ID buffer is fresh
+    hoverPicker.update(picker, scene, writesIdBuffer ? frameTargets.getFramebuffer() : 0, camera.getVersion(),
+        camera.getProjectionMatrix(), camera.getViewMatrix());
 
-    for (MeshObject* obj : objects) {
-        obj->render(false);
+    // Post-process AA resolves straight into the window instead of the blit
+    if (usePostProcess && aaMode == AA_FXAA) {
+        postAntiAliasing.applyFxaa(frameTargets.getColorTexture(), windowWidth, windowHeight);
+    }
+    else if (usePostProcess) {
+        postAntiAliasing.applySmaa(frameTargets.getColorTexture(), windowWidth, windowHeight);
+    }
+    else if (useTemporal) {
+        temporalAA.resolve(frameTargets.getColorTexture(), frameTargets.getDepthTexture(), windowWidth, windowHeight,
+            camera.getProjectionMatrix(), camera.getViewMatrix(), scene.getVersion(), camera.getVersion());
+    }
+    else if (useFrameTargets) {
+        frameTargets.blitToWindow();
     }
 
     // Display info
@@ -376,11 +3401,80 @@ void display() {
     glLoadIdentity();
 
     glColor3f(1, 1, 1);
-    std::string info = "Click objects to change color | Anti-aliasing: " + std::string(antiAliasing ? "ON" : "OFF");
+    std::string info = "Click objects to change color | Anti-aliasing: " + antiAliasingName(aaMode)
+        + " | Objects: " + std::to_string(scene.size()) + " | Picking: " + (pickMode == PICK_CPU ? "CPU" : "GPU");
+
+    drawOverlayLine(10, 20, info);
+
+    // A/B comparison of every AA mode measured so far
+    double fxaaMs = postAntiAliasing.getPassMs(PostAntiAliasing::PASS_FXAA);
+    double smaaEdgesMs = postAntiAliasing.getPassMs(PostAntiAliasing::PASS_SMAA_EDGES);
+    double smaaWeightsMs = postAntiAliasing.getPassMs(PostAntiAliasing::PASS_SMAA_WEIGHTS);
+    double smaaBlendMs = postAntiAliasing.getPassMs(PostAntiAliasing::PASS_SMAA_BLEND);
+    double taaMs = temporalAA.getResolveMs();
+    double postMs[AA_MODE_COUNT] = { 0.0 };
+    postMs[AA_FXAA] = fxaaMs;
+    postMs[AA_SMAA] = smaaEdgesMs + smaaWeightsMs + smaaBlendMs;
+    postMs[AA_TAA] = taaMs;
+
+    std::ostringstream timing;
+    timing << "GPU frame:";
+    for (int mode = 0; mode < AA_MODE_COUNT; mode++) {
+        if (aaTimers[mode].getMs() <= 0.0) continue;
+        timing << " | " << antiAliasingName(AntiAliasingMode(mode)) << " " << aaTimers[mode].getMs() + postMs[mode] << " ms";
+    }
 
-    glRasterPos2f(10, 20);
-    for (char c : info) {
-        glutBitmapCharacter(GLUT_BITMAP_9_BY_15, c);
+    drawOverlayLine(10, 160, timing.str());
+
+    if (fxaaMs > 0.0 || smaaBlendMs > 0.0 || taaMs > 0.0) {
+        std::ostringstream passes;
+        passes << "AA passes: FXAA " << fxaaMs << " ms | SMAA edges " << smaaEdgesMs << " + weights "
+            << smaaWeightsMs << " + blend " << smaaBlendMs << " ms | TAA resolve " << taaMs << " ms, "
+            << temporalAA.getSampleCount() << " samples";
+
+        drawOverlayLine(10, 180, passes.str());
+    }
+
+    std::ostringstream culling;
+    culling << "Culling: tested " << cullingStats.tested << " | visible " << cullingStats.visible
+        << " | " << cullingStats.timeMs << " ms | BVH height " << scene.getTreeHeight();
+
+    drawOverlayLine(10, 40, culling.str());
+
+    std::ostringstream queue;
+    queue << "Render queue: " << renderQueueStats.items << " draws | " << renderQueueStats.stateChanges
+        << " material switches | sort " << renderQueueStats.sortMs << " ms";
+
+    drawOverlayLine(10, 60, queue.str());
+
+    std::ostringstream picking;
+    picking << "Click picks: " << picker.getIdBufferPickCount() << " from ID buffer | "
+        << picker.getPassPickCount() << " with an ID pass";
+
+    drawOverlayLine(10, 80, picking.str());
+
+    std::ostringstream selection;
+    selection << "Selection: " << lastRegionResult.objectIndices.size() << " objects | scan "
+        << lastRegionResult.scanMs << " ms | " << (regionVisibleOnly ? "visible only" : "all in frustum");
+
+    drawOverlayLine(10, 100, selection.str());
+
+    std::ostringstream hover;
+    hover << "Hover: latency " << hoverPicker.getLatencyMs() << " ms | "
+        << hoverPicker.getPicksPerSecond() << " picks/s | " << picker.getHoverPickCount() << " total";
+
+    drawOverlayLine(10, 120, hover.str());
+
+    std::ostringstream targets;
+    targets << "Render targets: " << renderTargets.getTextureCount() << " textures, "
+        << renderTargets.getBytes() / (1024 * 1024) << " MB | " << renderTargets.getFramebufferCount()
+        << " FBOs | " << renderTargets.getAllocationCount() << " allocations";
+
+    drawOverlayLine(10, 140, targets.str());
+
+    if (regionDragging) {
+        glColor3f(1.0f, 0.9f, 0.2f);
+        drawRegionOutline();
     }
 
     glPopMatrix();
@@ -390,6 +3484,11 @@ void display() {
     glEnable(GL_LIGHTING);
 
     glutSwapBuffers();
+
+    // An idle TAA view keeps rendering until its history has converged
+    if (picker.hasPendingPicks() || regionPicker.hasPending() || (useTemporal && temporalAA.isConverging())) {
+        glutPostRedisplay();
+    }
 }
 
 void reshape(int w, int h) {
@@ -397,35 +3496,162 @@ void reshape(int w, int h) {
     windowHeight = h;
     glViewport(0, 0, w, h);
     picker.setWindowSize(w, h);
+    frameTargets.resize(w, h);
+}
+
+void onObjectClicked(const PickResult& result) {
+    std::cout << "Mouse: " << result.mouseX << ", " << result.mouseY << " -> ID: " << result.objectId
+        << " (" << result.latencyMs << " ms)" << std::endl;
+    if (result.hasHitPoint) {
+        std::cout << "Hit point: " << result.hitPoint.x << ", " << result.hitPoint.y << ", " << result.hitPoint.z << std::endl;
+    }
+    if (result.hasBarycentrics) {
+        std::cout << "Triangle " << result.triangleIndex << ", barycentric: " << result.barycentric.x << ", "
+            << result.barycentric.y << ", " << result.barycentric.z << std::endl;
+    }
+
+    if (result.objectIndex != -1) {
+        scene.setDiffuseColor(result.objectIndex, randomColor());
+        std::cout << ">>> Object " << result.objectIndex << " clicked! Color changed." << std::endl;
+        glutPostRedisplay();
+    }
+    else {
+        std::cout << "No object found!" << std::endl;
+    }
+}
+
+// Ray-casts the cursor through the live camera against the object BVH;
+// no GL round trip, so the result is available immediately
+PickResult pickObjectCpu(int x, int y) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Ray ray = Ray::fromWindow(x, y, windowWidth, windowHeight, camera.getProjectionMatrix(), camera.getViewMatrix());
+
+    PickResult result;
+    result.mouseX = x;
+    result.mouseY = y;
+    result.objectIndex = scene.raycast(ray, result.hitPoint);
+    result.hasHitPoint = result.objectIndex != -1;
+    result.objectId = result.objectIndex != -1 ? scene.getObjectId(result.objectIndex) : 0;
+    result.latencyMs = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    return result;
+}
+
+// Visible-only queries need an ID buffer, so they are read back right after
+// the next lit pass; everything else is answered from the BVH immediately
+void finishRegionSelect() {
+    regionDrag.visibleOnly = regionVisibleOnly;
+    if (regionDrag.lasso.size() >= 3) {
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+        for (const ScreenPoint& p : regionDrag.lasso) {
+            minX = std::min(minX, p.x);
+            minY = std::min(minY, p.y);
+            maxX = std::max(maxX, p.x);
+            maxY = std::max(maxY, p.y);
+        }
+        regionDrag.x0 = int(floorf(minX));
+        regionDrag.y0 = int(floorf(minY));
+        regionDrag.x1 = int(ceilf(maxX));
+        regionDrag.y1 = int(ceilf(maxY));
+    }
+    else {
+        regionDrag.lasso.clear();
+    }
+
+    if (regionVisibleOnly && litProgram != 0 && frameTargets.isComplete() && aaMode != AA_MSAA && aaMode != AA_TAA) {
+        regionQueued = true;
+    }
+    else {
+        RegionPickResult result;
+        regionPicker.selectInFrustum(regionDrag, scene, camera.getProjectionMatrix(), camera.getViewMatrix(),
+            windowWidth, windowHeight, result);
+        onRegionSelected(result);
+    }
 }
 
 void mouse(int button, int state, int x, int y) {
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_UP && regionDragging) {
+        regionDragging = false;
+        finishRegionSelect();
+        glutPostRedisplay();
+        return;
+    }
+
+    // Shift drags a rectangle, Ctrl drags a lasso
+    int modifiers = button == GLUT_LEFT_BUTTON && state == GLUT_DOWN ? glutGetModifiers() : 0;
+    if (modifiers & (GLUT_ACTIVE_SHIFT | GLUT_ACTIVE_CTRL)) {
+        regionDrag = RegionQuery();
+        regionDrag.x0 = regionDrag.x1 = x;
+        regionDrag.y0 = regionDrag.y1 = y;
+        if (modifiers & GLUT_ACTIVE_CTRL) {
+            regionDrag.lasso.push_back(ScreenPoint(float(x), float(y)));
+        }
+        regionDragging = true;
+        return;
+    }
+
     if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
         std::cout << "\n=== Mouse Click ===" << std::endl;
-        int pickedObject = picker.pickObject(x, y, objects);
-        if (pickedObject != -1) {
-            objects[pickedObject]->setDiffuseColor(randomColor());
-            std::cout << ">>> Object " << pickedObject << " clicked! Color changed." << std::endl;
+        if (pickMode == PICK_CPU) {
+            onObjectClicked(pickObjectCpu(x, y));
+        }
+        else {
+            // Reuse the last frame's ID buffer unless the view has changed since
+            if (frameTargets.isIdBufferCurrent(scene.getVersion(), camera.getVersion())) {
+                picker.requestPickFromIdBuffer(x, y, frameTargets.getFramebuffer(), GL_COLOR_ATTACHMENT1, scene,
+                    camera.getProjectionMatrix(), camera.getViewMatrix(), onObjectClicked);
+            }
+            else {
+                picker.requestPick(x, y, scene, camera.getProjectionMatrix(), camera.getViewMatrix(), onObjectClicked);
+            }
+            // The result arrives on a later frame; keep frames coming until it does
             glutPostRedisplay();
         }
     }
 }
 
+void motion(int x, int y) {
+    if (!regionDragging) return;
+
+    regionDrag.x1 = x;
+    regionDrag.y1 = y;
+    if (!regionDrag.lasso.empty()) {
+        const ScreenPoint& last = regionDrag.lasso.back();
+        if (fabsf(last.x - x) + fabsf(last.y - y) >= 2.0f) {
+            regionDrag.lasso.push_back(ScreenPoint(float(x), float(y)));
+        }
+    }
+    glutPostRedisplay();
+}
+
+// Only records the cursor; the hover pick itself is issued from display()
+void passiveMotion(int x, int y) {
+    hoverPicker.setCursor(x, y);
+    glutPostRedisplay();
+}
+
 void keyboard(unsigned char key, int x, int y) {
     switch (key) {
     case 27: exit(0); break; // ESC
     case 'r': case 'R': camera.reset(); break;
+    case 'n': case 'N': spawnObjectBatch(1000); break;
+    case 'c': case 'C': clearSpawnedObjects(); break;
+    case 'p': case 'P': pickMode = pickMode == PICK_CPU ? PICK_GPU : PICK_CPU; break;
+    case 'v': case 'V': regionVisibleOnly = !regionVisibleOnly; break;
     case 's': case 'S':
-        antiAliasing = !antiAliasing;
-        if (antiAliasing) {
-            glEnable(GL_LINE_SMOOTH);
-            glEnable(GL_POLYGON_SMOOTH);
-            glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-            glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
-        }
-        else {
-            glDisable(GL_LINE_SMOOTH);
-            glDisable(GL_POLYGON_SMOOTH);
+        if (aaMode == AA_TAA) temporalAA.releaseHistory();
+        aaMode = AntiAliasingMode((aaMode + 1) % AA_MODE_COUNT);
+        if (aaMode == AA_MSAA && maxMsaaSamples < 2) aaMode = AA_FXAA;
+        if ((aaMode == AA_FXAA || aaMode == AA_SMAA) && !postAntiAliasing.isAvailable()) aaMode = AA_TAA;
+        if (aaMode == AA_TAA && !temporalAA.isAvailable()) aaMode = AA_OFF;
+        if (aaMode == AA_TAA) temporalAA.reset();
+        std::cout << "Anti-aliasing: " << antiAliasingName(aaMode) << std::endl;
+        break;
+    case 'm': case 'M':
+        if (maxMsaaSamples >= 2) {
+            msaaSamples = msaaSamples * 2 > std::min(maxMsaaSamples, 8) ? 2 : msaaSamples * 2;
+            std::cout << "MSAA samples: " << msaaSamples << std::endl;
         }
         break;
     }
@@ -456,23 +3682,65 @@ void init() {
     if (!picker.initialize()) {
         std::cout << "Failed to initialize picking system!" << std::endl;
     }
+
+    std::vector<const char*> litOutputs = { "fragColor", "fragId" };
+    litProgram = createProgram(litVertexShader, litFragmentShader, litOutputs);
+    if (litProgram) {
+        litObjectIdLocation = glGetUniformLocation(litProgram, "objectId");
+    }
+    else {
+        std::cout << "MRT lit pass unavailable, picking falls back to an ID pass" << std::endl;
+    }
+
+    if (GLEW_ARB_texture_multisample) {
+        GLint colorSamples = 0, depthSamples = 0;
+        glGetIntegerv(GL_MAX_COLOR_TEXTURE_SAMPLES, &colorSamples);
+        glGetIntegerv(GL_MAX_DEPTH_TEXTURE_SAMPLES, &depthSamples);
+        maxMsaaSamples = std::min(colorSamples, depthSamples);
+        msaaSamples = std::min(msaaSamples, std::max(maxMsaaSamples, 2));
+    }
+
+    for (int mode = 0; mode < AA_MODE_COUNT; mode++) {
+        aaTimers[mode].initialize();
+    }
+
+    if (!litProgram || !postAntiAliasing.initialize()) {
+        std::cout << "Post-process anti-aliasing unavailable" << std::endl;
+    }
+
+    if (!litProgram || !temporalAA.initialize()) {
+        std::cout << "Temporal anti-aliasing unavailable" << std::endl;
+    }
 }
 
 void cleanup() {
-    for (MeshObject* obj : objects) {
-        delete obj;
-    }
-    objects.clear();
+    spawnedObjects.clear();
+    scene.clear();
     picker.cleanup();
+    regionPicker.cleanup();
+    frameTargets.cleanup();
+    postAntiAliasing.cleanup();
+    temporalAA.cleanup();
+    renderTargets.cleanup();
+    for (int mode = 0; mode < AA_MODE_COUNT; mode++) {
+        aaTimers[mode].cleanup();
+    }
+    if (litProgram) glDeleteProgram(litProgram);
 }
 
 void printControls() {
     std::cout << "\n=== Part 2: Anti-aliasing and Picking Controls ===" << std::endl;
     std::cout << "Mouse Click: Select object (changes color)" << std::endl;
+    std::cout << "Shift+Drag / Ctrl+Drag: Rectangle / lasso selection" << std::endl;
     std::cout << "Arrow keys: Rotate camera" << std::endl;
     std::cout << "Page Up/Down: Zoom in/out" << std::endl;
     std::cout << "R: Reset view" << std::endl;
-    std::cout << "S: Toggle anti-aliasing" << std::endl;
+    std::cout << "S: Cycle anti-aliasing mode" << std::endl;
+    std::cout << "M: Cycle MSAA sample count (2/4/8)" << std::endl;
+    std::cout << "N: Spawn 1000 objects" << std::endl;
+    std::cout << "C: Remove spawned objects" << std::endl;
+    std::cout << "P: Toggle CPU ray-cast / GPU picking" << std::endl;
+    std::cout << "V: Toggle visible-only / all-in-frustum selection" << std::endl;
     std::cout << "ESC: Exit" << std::endl;
 }
 
@@ -493,12 +3761,19 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (!GLEW_ARB_sync || !GLEW_ARB_pixel_buffer_object) {
+        std::cout << "Fence sync / pixel buffer objects not supported!" << std::endl;
+        return 1;
+    }
+
     init();
     printControls();
 
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutMouseFunc(mouse);
+    glutMotionFunc(motion);
+    glutPassiveMotionFunc(passiveMotion);
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(specialKeys);
 
@@ -0,0 +1,148 @@
+// Headless test of the CPU pick path in main_part2.cpp: SceneStore::raycast
+// through Ray::fromWindow. It needs no window and no GL context; the GL
+// libraries are only linked because the application is one translation unit.
+// Exits with 0 when every check passes.
+#define main main_part2_main
+#include "main_part2.cpp"
+#undef main
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            failures++; \
+            std::printf("FAILED %s:%d: ", __FILE__, __LINE__); \
+            std::printf(__VA_ARGS__); \
+            std::printf("\n"); \
+        } \
+    } while (0)
+
+static const int TEST_WIDTH = 800;
+static const int TEST_HEIGHT = 600;
+
+static float distance(const Vertex& a, const Vertex& b) {
+    float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+// Deterministic [0, 1) so failures reproduce
+static float nextRandom(uint32_t& state) {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Closest cube by testing every object, without the tree
+static int bruteForceRaycast(const SceneStore& scene, const Ray& ray, Vertex& hitPoint) {
+    int hitIndex = -1;
+    float hitDistance = 1e30f;
+    for (size_t i = 0; i < scene.size(); i++) {
+        float t;
+        if (ray.intersects(scene.getBounds(i), hitDistance, t) && t < hitDistance) {
+            hitIndex = static_cast<int>(i);
+            hitDistance = t;
+        }
+    }
+    if (hitIndex != -1) hitPoint = ray.at(hitDistance);
+    return hitIndex;
+}
+
+// Window pixel (GLUT coordinates) that a world point projects to
+static void projectToWindow(const Matrix4& viewProjection, const Vertex& point, float& x, float& y) {
+    Vertex ndc = viewProjection.transformPoint(point);
+    x = (ndc.x + 1.0f) * 0.5f * TEST_WIDTH;
+    y = (1.0f - ndc.y) * 0.5f * TEST_HEIGHT;
+}
+
+// One cube straight ahead: the center pixel hits the middle of its near face
+static void testSingleCube() {
+    SceneStore scene;
+    scene.create(Vertex(0.0f, 0.0f, 0.0f), Color(1.0f, 0.0f, 0.0f), 7, 0.5f);
+
+    Matrix4 projection = Matrix4::perspective(45.0f, float(TEST_WIDTH) / TEST_HEIGHT, 0.1f, 100.0f);
+    Matrix4 view = Matrix4::lookAt(Vertex(0.0f, 0.0f, 5.0f), Vertex(0.0f, 0.0f, 0.0f), Vertex(0.0f, 1.0f, 0.0f));
+
+    Vertex hitPoint;
+    Ray ray = Ray::fromWindow(TEST_WIDTH / 2, TEST_HEIGHT / 2, TEST_WIDTH, TEST_HEIGHT, projection, view);
+    int index = scene.raycast(ray, hitPoint);
+    CHECK(index == 0, "center pixel picked %d, expected 0", index);
+    CHECK(index == -1 || scene.getObjectId(index) == 7, "center pixel picked ID %d", scene.getObjectId(index));
+    CHECK(fabsf(hitPoint.z - 0.5f) < 1e-4f && fabsf(hitPoint.x) < 0.01f && fabsf(hitPoint.y) < 0.01f,
+        "hit point (%f, %f, %f), expected about (0, 0, 0.5)", hitPoint.x, hitPoint.y, hitPoint.z);
+
+    ray = Ray::fromWindow(5, 5, TEST_WIDTH, TEST_HEIGHT, projection, view);
+    index = scene.raycast(ray, hitPoint);
+    CHECK(index == -1, "corner pixel picked %d, expected a miss", index);
+}
+
+// Random clicks over a crowded scene, including moved and destroyed
+// objects, checked against a brute-force ray cast. The hit point must also
+// project back onto the clicked pixel center.
+static void testRandomClicks() {
+    const int OBJECT_COUNT = 3000;
+    const int CLICK_COUNT = 500;
+    uint32_t state = 12345u;
+
+    SceneStore scene;
+    std::vector<ObjectHandle> handles;
+    for (int i = 0; i < OBJECT_COUNT; i++) {
+        Vertex pos(nextRandom(state) * 20.0f - 10.0f, nextRandom(state) * 20.0f - 10.0f, nextRandom(state) * 20.0f - 10.0f);
+        float scale = 0.05f + nextRandom(state) * 0.25f;
+        handles.push_back(scene.create(pos, Color(1.0f, 1.0f, 1.0f), i + 1, scale));
+    }
+    for (int i = 0; i < OBJECT_COUNT; i += 10) {
+        int index = scene.indexOf(handles[i]);
+        Vertex pos = scene.getPosition(index);
+        scene.setPosition(index, Vertex(pos.x + 1.5f, pos.y - 0.5f, pos.z));
+    }
+    for (int i = 5; i < OBJECT_COUNT; i += 25) scene.destroy(handles[i]);
+
+    Vertex eye(18.0f, 12.0f, 22.0f);
+    Matrix4 projection = Matrix4::perspective(45.0f, float(TEST_WIDTH) / TEST_HEIGHT, 0.1f, 100.0f);
+    Matrix4 view = Matrix4::lookAt(eye, Vertex(0.0f, 0.0f, 0.0f), Vertex(0.0f, 1.0f, 0.0f));
+    Matrix4 viewProjection = projection * view;
+
+    int hits = 0;
+    for (int click = 0; click < CLICK_COUNT; click++) {
+        int x = static_cast<int>(nextRandom(state) * TEST_WIDTH);
+        int y = static_cast<int>(nextRandom(state) * TEST_HEIGHT);
+        Ray ray = Ray::fromWindow(x, y, TEST_WIDTH, TEST_HEIGHT, projection, view);
+
+        Vertex hitPoint, expectedPoint;
+        int index = scene.raycast(ray, hitPoint);
+        int expected = bruteForceRaycast(scene, ray, expectedPoint);
+        CHECK(index == expected, "click (%d, %d) picked %d, expected %d", x, y, index, expected);
+        if (index == -1 || index != expected) continue;
+        hits++;
+
+        CHECK(distance(hitPoint, expectedPoint) < 1e-4f, "click (%d, %d) hit point off by %f",
+            x, y, distance(hitPoint, expectedPoint));
+        AABB box = scene.getBounds(index);
+        const float EPSILON = 1e-4f;
+        CHECK(hitPoint.x >= box.min.x - EPSILON && hitPoint.x <= box.max.x + EPSILON &&
+            hitPoint.y >= box.min.y - EPSILON && hitPoint.y <= box.max.y + EPSILON &&
+            hitPoint.z >= box.min.z - EPSILON && hitPoint.z <= box.max.z + EPSILON,
+            "click (%d, %d) hit point outside the picked cube", x, y);
+
+        float px, py;
+        projectToWindow(viewProjection, hitPoint, px, py);
+        CHECK(fabsf(px - (x + 0.5f)) < 0.05f && fabsf(py - (y + 0.5f)) < 0.05f,
+            "click (%d, %d) hit point projects to (%f, %f)", x, y, px, py);
+    }
+    CHECK(hits > CLICK_COUNT / 4, "only %d of %d clicks hit an object", hits, CLICK_COUNT);
+    std::printf("%d random clicks, %d hits\n", CLICK_COUNT, hits);
+}
+
+int main() {
+    testSingleCube();
+    testRandomClicks();
+
+    if (failures) {
+        std::printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("All pick tests passed\n");
+    return 0;
+}